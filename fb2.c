@@ -1,44 +1,20 @@
 /* gcc -arch i386 -O3 -o fb2 fb2.c -framework ApplicationServices -framework Carbon
+ * gcc -O3 -o fb2 fb2.c    (elsewhere; see fbscreen.h)
  */
 #include <stdint.h>
 #include <stdlib.h>
 #include <sys/time.h>
 
-#include <ApplicationServices/ApplicationServices.h>
+#include "fbscreen.h"
+#include "fbpace.h"
+#include "fbbench.h"
 
-static char *fontdata[]; /* forward declaration */
+#define TARGET_FPS 0 /* as fast as possible */
 
-static struct {
-  uint32_t *base;
-  int width;
-  int height;
-  int stride;
-} screen;
+static char *fontdata[]; /* forward declaration */
 
 static int frame_counter = 0;
 
-static void setup_screen(void) {
-  CGDirectDisplayID targetDisplay = kCGDirectMainDisplay;
-
-  CGDisplayCapture(targetDisplay); /* crucial for being permitted to write on it */
-  screen.base = (uint32_t *) CGDisplayBaseAddress(targetDisplay);
-  screen.stride = CGDisplayBytesPerRow(targetDisplay) / sizeof(uint32_t);
-  screen.width = CGDisplayPixelsWide(targetDisplay);
-  screen.height = CGDisplayPixelsHigh(targetDisplay);
-}
-
-static void clrscr(void) {
-  memset(screen.base, 0, ((screen.height-1) * screen.stride + screen.width) * sizeof(uint32_t));
-}
-
-static void putpixel(int x, int y, int c) {
-  screen.base[y * screen.stride + x] = c;
-}
-
-static int getpixel(int x, int y) {
-  return screen.base[y * screen.stride + x];
-}
-
 static int glyph_pixel(char c, unsigned int x, unsigned int y) {
   int row = (c / 16) * 16 + (y % 16);
   int col = (c % 16) * 16 + (x % 8) + 5;
@@ -51,7 +27,7 @@ static void do_frame() {
   int messagelen = strlen(message);
   int x, y;
 
-  GetMouse(&loc);
+  input_mouse(&loc);
 
   for (y = 0; y < screen.height; y++) {
     for (x = 0; x < screen.width; x++) {
@@ -73,7 +49,7 @@ static void do_frame0() {
   Point loc;
   int x, y, c;
 
-  GetMouse(&loc);
+  input_mouse(&loc);
 
   c = 0;
   /* memset(screen, c, ((height-1) * stride + width) * sizeof(pix_t)); */
@@ -93,25 +69,38 @@ static void do_frame0() {
 
 int main(int argc, char *argv[]) {
   struct timeval t_start, t_stop;
+  struct pacer pacer;
 
-  setup_screen();
+  bench_parse_args(argc, argv);
+  setup_screen(SCREEN_REDRAW);
 
   gettimeofday(&t_start, NULL);
+  pacer_start(&pacer, bench_fps(TARGET_FPS));
+  bench_start();
 
   frame_counter = 0;
-  while (!Button()) {
+  while (bench_running(frame_counter) && !input_button()) {
+    bench_begin(PHASE_DRAW);
     do_frame();
+    bench_end(PHASE_DRAW);
+    bench_begin(PHASE_PRESENT);
+    screen_present();
+    bench_end(PHASE_PRESENT);
+    bench_frame_done(frame_counter);
     frame_counter++;
+    pacer_wait(&pacer);
   }
 
   gettimeofday(&t_stop, NULL);
 
   {
     long delta = (t_stop.tv_sec - t_start.tv_sec) * 1000000 + (t_stop.tv_usec - t_start.tv_usec);
-    printf("%d frames took %lu microseconds, so %g frames/sec\n",
+    fprintf(bench.log, "%d frames took %lu microseconds, so %g frames/sec\n",
 	   frame_counter,
 	   delta,
 	   frame_counter / (delta / 1000000.0));
+    pacer_report(&pacer, bench.log);
+    bench_report(&pacer);
   }
 }
 
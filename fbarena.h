@@ -0,0 +1,40 @@
+/* Big anonymous mappings for particle arrays.
+ *
+ *   p = arena_alloc(size);
+ *
+ * Explicit huge pages are tried first, then we ask for transparent
+ * ones, so that arrays the physics sweeps every frame cost few TLB
+ * entries. The mapping starts on a page, so on a cache line too, and
+ * is zeroed. It lives as long as the program; exits if there is no
+ * memory.
+ */
+#ifndef FBARENA_H
+#define FBARENA_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#define ARENA_HUGE_PAGE (2 << 20)
+
+static inline void *arena_alloc(size_t size) {
+  void *p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+  size_t huge = (size + ARENA_HUGE_PAGE - 1) & ~(size_t) (ARENA_HUGE_PAGE - 1);
+  p = mmap(NULL, huge, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+  if (p == MAP_FAILED) {
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+      perror("mmap");
+      exit(1);
+    }
+#ifdef MADV_HUGEPAGE
+    madvise(p, size, MADV_HUGEPAGE);
+#endif
+  }
+  return p;
+}
+
+#endif
@@ -0,0 +1,367 @@
+/* Benchmark mode.
+ *
+ *   --frames N     stop after N frames, unpaced
+ *   --headless     draw on an anonymous fake framebuffer (see fbscreen.h)
+ *   --size WxH     ... of this size; the default is 1920x1080
+ *   --seed N       seed the random numbers (see fbrand.h) with N, not the time
+ *   --json         one JSON object per frame on stdout, then a summary;
+ *                  the usual human-readable output moves to stderr
+ *   --trace FILE   write a Chrome trace of the frame phases to FILE (see fbtrace.h)
+ *   --threads N    use N threads where the demo can (see fbpool.h)
+ *
+ * Any of these turns off the real mouse and keyboard: the demos see
+ * the mouse parked at (100, 100) and nothing pressed, so two runs with
+ * the same seed do exactly the same work.
+ *
+ * Demos bracket the interesting parts of a frame with bench_begin()
+ * and bench_end(), and call bench_frame_done() once per frame. The
+ * phases also show up in traces. Anything else worth watching, like
+ * how many particles are still alive, can be reported each frame with
+ * bench_stat(); the report gives its mean.
+ *
+ * On Linux the phases also count last-level cache misses and data TLB
+ * misses, where perf_event_open() lets us (see perf_event_paranoid),
+ * and the report gives those per frame too. The counters follow the
+ * thread that called bench_parse_args() and any threads it starts
+ * afterwards, like fbpool.h's, so a phase counts whatever all of them
+ * did while it ran.
+ */
+#ifndef FBBENCH_H
+#define FBBENCH_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "fbscreen.h"
+#include "fbpace.h"
+#include "fbtrace.h"
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#define PHASE_FADE 0
+#define PHASE_PHYSICS 1
+#define PHASE_EROSION 2
+#define PHASE_SHADING 3
+#define PHASE_DRAW 4
+#define PHASE_PRESENT 5
+#define N_PHASES 6
+
+static const char *phase_names[N_PHASES] = {
+  "fade", "physics", "erosion", "shading", "draw", "present"
+};
+
+#define N_STATS 8
+/* Stats run from counts in the millions to drifts of 1e-8, so they
+   get significant digits rather than places. */
+#define STAT_FORMAT "%.7g"
+
+#define N_COUNTERS 2
+
+static const char *counter_names[N_COUNTERS] = {
+  "llc_misses", "dtlb_misses"
+};
+
+static struct bench {
+  int on;
+  int frames;       /* 0 for no limit */
+  int json;
+  unsigned long seed;
+  int seeded;
+  const char *name;
+  FILE *log;        /* where the human-readable output goes */
+  unsigned used;    /* bitmask of phases seen */
+  struct timespec frame_start;
+  struct timespec phase_start[N_PHASES];
+  uint64_t phase_tsc[N_PHASES];
+  uint64_t phase_ns[N_PHASES];
+  uint64_t total_phase_ns[N_PHASES];
+  uint64_t total_ns;
+  long frames_done;
+  int n_stats;
+  const char *stat_names[N_STATS];
+  unsigned stat_set;  /* bitmask of stats given this frame */
+  double stat[N_STATS];
+  double total_stat[N_STATS];
+  long stat_frames[N_STATS];
+  int counter_fd[N_COUNTERS];   /* -1 where unavailable */
+  int counters;                 /* nonzero if any are available */
+  uint64_t counter_start[N_PHASES][N_COUNTERS];
+  uint64_t total_counter[N_PHASES][N_COUNTERS];
+} bench;
+
+static void bench_usage(const char *argv0) {
+  fprintf(stderr, "usage: %s [--frames N] [--headless] [--size WxH] [--seed N] [--json] [--trace FILE] [--threads N]\n",
+	  argv0);
+  exit(1);
+}
+
+#ifdef __linux__
+static int bench_open_counter(uint32_t type, uint64_t config) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.inherit = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+static void bench_open_counters(void) {
+  int i;
+
+  for (i = 0; i < N_COUNTERS; i++) {
+    bench.counter_fd[i] = -1;
+  }
+#ifdef __linux__
+  bench.counter_fd[0] = bench_open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+  bench.counter_fd[1] = bench_open_counter(PERF_TYPE_HW_CACHE,
+					   PERF_COUNT_HW_CACHE_DTLB
+					   | PERF_COUNT_HW_CACHE_OP_READ << 8
+					   | PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+#endif
+  for (i = 0; i < N_COUNTERS; i++) {
+    if (bench.counter_fd[i] >= 0) bench.counters = 1;
+  }
+  if (!bench.counters) {
+    fprintf(bench.log, "hardware counters unavailable\n");
+  }
+}
+
+static void bench_read_counters(uint64_t *values) {
+  int i;
+  for (i = 0; i < N_COUNTERS; i++) {
+    values[i] = 0;
+    if (bench.counter_fd[i] >= 0 && read(bench.counter_fd[i], &values[i], sizeof(values[i])) != sizeof(values[i])) {
+      values[i] = 0;
+    }
+  }
+}
+
+static void bench_parse_args(int argc, char *argv[]) {
+  const char *size = "1920x1080";
+  const char *trace_path = NULL;
+  int headless = 0;
+  int i;
+
+  bench.name = strrchr(argv[0], '/') ? strrchr(argv[0], '/') + 1 : argv[0];
+  bench.log = stdout;
+
+  for (i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--frames") && i + 1 < argc) {
+      bench.frames = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "--headless")) {
+      headless = 1;
+    } else if (!strcmp(argv[i], "--size") && i + 1 < argc) {
+      size = argv[++i];
+    } else if (!strcmp(argv[i], "--seed") && i + 1 < argc) {
+      bench.seed = strtoul(argv[++i], NULL, 0);
+      bench.seeded = 1;
+    } else if (!strcmp(argv[i], "--trace") && i + 1 < argc) {
+      trace_path = argv[++i];
+    } else if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+      setenv("FB_THREADS", argv[++i], 1);
+    } else if (!strcmp(argv[i], "--json")) {
+      bench.json = 1;
+      bench.log = stderr;
+    } else {
+      bench_usage(argv[0]);
+    }
+  }
+
+  bench.on = bench.frames || headless || bench.seeded || bench.json;
+  if (bench.on) {
+    input_synthetic = 1;
+    if (!bench.seeded) {
+      bench.seed = 1;
+    }
+  }
+  if (bench.on) {
+    bench_open_counters();
+  }
+  if (headless) {
+    char target[64];
+    snprintf(target, sizeof(target), "anon:%s", size);
+    setenv("FB_TARGET", target, 1);
+  }
+  trace_start(trace_path);
+}
+
+static inline unsigned long bench_seed(void) {
+  return bench.on ? bench.seed : (unsigned long) time(NULL);
+}
+
+/* Benchmarks run flat out. */
+static int bench_fps(int fps) {
+  return bench.on ? 0 : fps;
+}
+
+/* Keep going? */
+static int bench_running(int frame_counter) {
+  return bench.frames == 0 || frame_counter < bench.frames;
+}
+
+static void bench_begin(int phase) {
+  if (bench.on) {
+    if (bench.counters) bench_read_counters(bench.counter_start[phase]);
+    clock_gettime(CLOCK_MONOTONIC, &bench.phase_start[phase]);
+  }
+  if (__builtin_expect(trace.on, 0)) {
+    bench.phase_tsc[phase] = trace_now();
+  }
+}
+
+static void bench_end(int phase) {
+  if (bench.on) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    bench.phase_ns[phase] += ts_nsec(now) - ts_nsec(bench.phase_start[phase]);
+    bench.used |= 1 << phase;
+    if (bench.counters) {
+      uint64_t values[N_COUNTERS];
+      int i;
+      bench_read_counters(values);
+      for (i = 0; i < N_COUNTERS; i++) {
+	bench.total_counter[phase][i] += values[i] - bench.counter_start[phase][i];
+      }
+    }
+  }
+  if (__builtin_expect(trace.on, 0)) {
+    trace_record(phase_names[phase], bench.phase_tsc[phase], trace_now());
+  }
+}
+
+/* Records this frame's value of a statistic. */
+static inline void bench_stat(const char *name, double value) {
+  int i;
+
+  if (!bench.on) return;
+
+  for (i = 0; i < bench.n_stats; i++) {
+    if (!strcmp(bench.stat_names[i], name)) break;
+  }
+  if (i == bench.n_stats) {
+    if (i == N_STATS) return;
+    bench.stat_names[bench.n_stats++] = name;
+  }
+  bench.stat[i] = value;
+  bench.stat_set |= 1 << i;
+}
+
+static void bench_start(void) {
+  if (bench.on) {
+    clock_gettime(CLOCK_MONOTONIC, &bench.frame_start);
+  }
+}
+
+static void bench_frame_done(int frame_counter) {
+  struct timespec now;
+  uint64_t ns;
+  int i;
+
+  if (!bench.on) return;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  ns = ts_nsec(now) - ts_nsec(bench.frame_start);
+  bench.frame_start = now;
+  bench.total_ns += ns;
+  bench.frames_done++;
+
+  if (bench.json) {
+    printf("{\"demo\":\"%s\",\"frame\":%d,\"us\":%.3f", bench.name, frame_counter, ns / 1000.0);
+    for (i = 0; i < N_PHASES; i++) {
+      if (bench.used & (1 << i)) {
+	printf(",\"%s\":%.3f", phase_names[i], bench.phase_ns[i] / 1000.0);
+      }
+    }
+    for (i = 0; i < bench.n_stats; i++) {
+      if (bench.stat_set & (1 << i)) {
+	printf(",\"%s\":" STAT_FORMAT, bench.stat_names[i], bench.stat[i]);
+      }
+    }
+    printf("}\n");
+  }
+
+  for (i = 0; i < N_PHASES; i++) {
+    bench.total_phase_ns[i] += bench.phase_ns[i];
+    bench.phase_ns[i] = 0;
+  }
+  for (i = 0; i < bench.n_stats; i++) {
+    if (bench.stat_set & (1 << i)) {
+      bench.total_stat[i] += bench.stat[i];
+      bench.stat_frames[i]++;
+    }
+  }
+  bench.stat_set = 0;
+}
+
+static void bench_report(struct pacer *pacer) {
+  int i, k;
+  long n = bench.frames_done;
+
+  if (!bench.on || n == 0) return;
+
+  if (bench.json) {
+    printf("{\"demo\":\"%s\",\"summary\":true,\"frames\":%ld,\"width\":%d,\"height\":%d,\"seed\":%lu,"
+	   "\"mean_us\":%.3f,\"p50_us\":%lu,\"p95_us\":%lu,\"p99_us\":%lu,\"max_us\":%lu",
+	   bench.name, n, screen.width, screen.height, bench.seed,
+	   bench.total_ns / 1000.0 / n,
+	   (unsigned long) pacer_percentile(pacer, 50),
+	   (unsigned long) pacer_percentile(pacer, 95),
+	   (unsigned long) pacer_percentile(pacer, 99),
+	   (unsigned long) pacer->max);
+    for (i = 0; i < N_PHASES; i++) {
+      if (bench.used & (1 << i)) {
+	printf(",\"%s_us\":%.3f", phase_names[i], bench.total_phase_ns[i] / 1000.0 / n);
+      }
+    }
+    for (i = 0; i < bench.n_stats; i++) {
+      printf(",\"%s_mean\":" STAT_FORMAT, bench.stat_names[i], bench.total_stat[i] / bench.stat_frames[i]);
+    }
+    for (i = 0; i < N_PHASES; i++) {
+      for (k = 0; k < N_COUNTERS; k++) {
+	if ((bench.used & (1 << i)) && bench.counter_fd[k] >= 0) {
+	  printf(",\"%s_%s\":%.1f", phase_names[i], counter_names[k], (double) bench.total_counter[i][k] / n);
+	}
+      }
+    }
+    printf("}\n");
+  } else {
+    fprintf(bench.log, "mean per frame:");
+    for (i = 0; i < N_PHASES; i++) {
+      if (bench.used & (1 << i)) {
+	fprintf(bench.log, " %s %.1f", phase_names[i], bench.total_phase_ns[i] / 1000.0 / n);
+      }
+    }
+    fprintf(bench.log, " microseconds\n");
+    if (bench.n_stats) {
+      fprintf(bench.log, "mean per frame:");
+      for (i = 0; i < bench.n_stats; i++) {
+	fprintf(bench.log, " %s " STAT_FORMAT, bench.stat_names[i], bench.total_stat[i] / bench.stat_frames[i]);
+      }
+      fprintf(bench.log, "\n");
+    }
+    for (k = 0; k < N_COUNTERS; k++) {
+      if (bench.counter_fd[k] < 0) continue;
+      fprintf(bench.log, "%s per frame:", counter_names[k]);
+      for (i = 0; i < N_PHASES; i++) {
+	if (bench.used & (1 << i)) {
+	  fprintf(bench.log, " %s %.0f", phase_names[i], (double) bench.total_counter[i][k] / n);
+	}
+      }
+      fprintf(bench.log, "\n");
+    }
+  }
+}
+
+#endif
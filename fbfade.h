@@ -0,0 +1,243 @@
+/* Fading XRGB pixels by a constant factor.
+ *
+ * The demos fade with
+ *
+ *   R = (int) R * FADE_FACTOR;   and the same for G and B
+ *
+ * which, for any factor between 254/255 and 1, knocks exactly one off
+ * every nonzero channel. fade_span() spots that case and does it with
+ * a saturating byte subtract, 4, 8 or 16 pixels at a time depending
+ * on what the CPU has; any other factor goes through a lookup table.
+ * Either way the result is bit for bit what the scalar code gives,
+ * including clearing the top byte.
+ *
+ * Because fading then only depends on the colour drawn and how many
+ * frames ago it was drawn, it can also be done lazily: draw colours
+ * with the low byte of the frame number in the top byte, and have
+ * fade_resolve() work out the faded colour while copying to the
+ * screen. fade_resolve() clears pixels as they go fully dark, at 255
+ * frames old, so every lit pixel must pass through it every frame.
+ *
+ * Or the fade can ride along with presenting: fade_present() copies a
+ * span to the screen as it is and leaves it faded behind, ready for
+ * the next frame, so the pixels are only read once between them. It
+ * writes the screen with streaming stores, which don't drag the
+ * framebuffer through the cache.
+ */
+#ifndef FBFADE_H
+#define FBFADE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* the same as fbscreen.h's, which this doesn't otherwise need */
+#ifndef MAX
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define MIN(a, b) ((a) > (b) ? (b) : (a))
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+static uint8_t fade_lut[256];
+static int fade_decrements;  /* nonzero when fading subtracts one per channel */
+static uint32_t fade_now;    /* the frame fade_resolve() resolves for */
+static void (*fade_span)(uint32_t *p, size_t n);
+static void (*fade_resolve)(uint32_t *dst, uint32_t *src, size_t n);
+static void (*fade_present)(uint32_t *dst, uint32_t *src, size_t n);
+
+static uint32_t fade_pixel(uint32_t p) {
+  return (fade_lut[(p >> 16) & 0xff] << 16) | (fade_lut[(p >> 8) & 0xff] << 8) | fade_lut[p & 0xff];
+}
+
+static void fade_span_lut(uint32_t *p, size_t n) {
+  size_t i;
+  for (i = 0; i < n; i++) {
+    if (p[i]) p[i] = fade_pixel(p[i]);
+  }
+}
+
+/* The decrement case, one pixel at a time. */
+static uint32_t fade_pixel_dec(uint32_t p) {
+  uint32_t nz = p | (p >> 1) | (p >> 2) | (p >> 3) | (p >> 4) | (p >> 5) | (p >> 6) | (p >> 7);
+  return (p & 0x00ffffff) - (nz & 0x00010101);
+}
+
+static void fade_span_dec(uint32_t *p, size_t n) {
+  size_t i;
+  for (i = 0; i < n; i++) {
+    p[i] = fade_pixel_dec(p[i]);
+  }
+}
+
+static void fade_present_lut(uint32_t *dst, uint32_t *src, size_t n) {
+  size_t i;
+  for (i = 0; i < n; i++) {
+    uint32_t p = src[i];
+    dst[i] = p;
+    if (p) src[i] = fade_pixel(p);
+  }
+}
+
+static void fade_present_dec(uint32_t *dst, uint32_t *src, size_t n) {
+  size_t i;
+  for (i = 0; i < n; i++) {
+    uint32_t p = src[i];
+    dst[i] = p;
+    src[i] = fade_pixel_dec(p);
+  }
+}
+
+static void fade_resolve_scalar(uint32_t *dst, uint32_t *src, size_t n) {
+  size_t i;
+  for (i = 0; i < n; i++) {
+    uint32_t p = src[i];
+    uint32_t age = (fade_now - (p >> 24)) & 0xff;
+    uint32_t c = p & 0x00ffffff;
+    uint32_t r = MAX((int) (c >> 16) - (int) age, 0);
+    uint32_t g = MAX((int) ((c >> 8) & 0xff) - (int) age, 0);
+    uint32_t b = MAX((int) (c & 0xff) - (int) age, 0);
+    dst[i] = (r << 16) | (g << 8) | b;
+    if (age == 0xff) src[i] = 0;
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+static void fade_resolve_avx2(uint32_t *dst, uint32_t *src, size_t n) {
+  const __m256i mask = _mm256_set1_epi32(0x00ffffff);
+  const __m256i spread = _mm256_set1_epi32(0x00010101);
+  const __m256i dark = _mm256_set1_epi32(0xff);
+  const __m256i now = _mm256_set1_epi32(fade_now << 24);
+  size_t i;
+  for (i = 0; i + 8 <= n; i += 8) {
+    __m256i p = _mm256_loadu_si256((__m256i *) (src + i));
+    __m256i age = _mm256_srli_epi32(_mm256_sub_epi32(now, _mm256_andnot_si256(mask, p)), 24);
+    __m256i faded = _mm256_subs_epu8(_mm256_and_si256(p, mask), _mm256_mullo_epi32(age, spread));
+    __m256i expired = _mm256_cmpeq_epi32(age, dark);
+    _mm256_storeu_si256((__m256i *) (dst + i), faded);
+    if (!_mm256_testz_si256(expired, expired)) {
+      _mm256_storeu_si256((__m256i *) (src + i), _mm256_andnot_si256(expired, p));
+    }
+  }
+  fade_resolve_scalar(dst + i, src + i, n - i);
+}
+
+/* The streaming stores want dst aligned, so the first few pixels up to
+   that go the ordinary way. */
+__attribute__((target("avx2")))
+static void fade_present_avx2(uint32_t *dst, uint32_t *src, size_t n) {
+  const __m256i mask = _mm256_set1_epi32(0x00ffffff);
+  const __m256i one = _mm256_set1_epi32(0x00010101);
+  size_t i = MIN(n, (-(uintptr_t) dst & 31) / sizeof(uint32_t));
+  fade_present_dec(dst, src, i);
+  for (; i + 8 <= n; i += 8) {
+    __m256i v = _mm256_loadu_si256((__m256i *) (src + i));
+    _mm256_stream_si256((__m256i *) (dst + i), v);
+    _mm256_storeu_si256((__m256i *) (src + i), _mm256_subs_epu8(_mm256_and_si256(v, mask), one));
+  }
+  fade_present_dec(dst + i, src + i, n - i);
+  _mm_sfence();
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void fade_present_avx512(uint32_t *dst, uint32_t *src, size_t n) {
+  const __m512i mask = _mm512_set1_epi32(0x00ffffff);
+  const __m512i one = _mm512_set1_epi32(0x00010101);
+  size_t i = MIN(n, (-(uintptr_t) dst & 63) / sizeof(uint32_t));
+  fade_present_dec(dst, src, i);
+  for (; i + 16 <= n; i += 16) {
+    __m512i v = _mm512_loadu_si512((void *) (src + i));
+    _mm512_stream_si512((void *) (dst + i), v);
+    _mm512_storeu_si512((void *) (src + i), _mm512_subs_epu8(_mm512_and_si512(v, mask), one));
+  }
+  fade_present_dec(dst + i, src + i, n - i);
+  _mm_sfence();
+}
+
+__attribute__((target("sse2")))
+static void fade_span_sse2(uint32_t *p, size_t n) {
+  const __m128i mask = _mm_set1_epi32(0x00ffffff);
+  const __m128i one = _mm_set1_epi32(0x00010101);
+  size_t i;
+  for (i = 0; i + 4 <= n; i += 4) {
+    __m128i v = _mm_loadu_si128((__m128i *) (p + i));
+    _mm_storeu_si128((__m128i *) (p + i), _mm_subs_epu8(_mm_and_si128(v, mask), one));
+  }
+  fade_span_dec(p + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void fade_span_avx2(uint32_t *p, size_t n) {
+  const __m256i mask = _mm256_set1_epi32(0x00ffffff);
+  const __m256i one = _mm256_set1_epi32(0x00010101);
+  size_t i;
+  for (i = 0; i + 8 <= n; i += 8) {
+    __m256i v = _mm256_loadu_si256((__m256i *) (p + i));
+    _mm256_storeu_si256((__m256i *) (p + i), _mm256_subs_epu8(_mm256_and_si256(v, mask), one));
+  }
+  fade_span_dec(p + i, n - i);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void fade_span_avx512(uint32_t *p, size_t n) {
+  const __m512i mask = _mm512_set1_epi32(0x00ffffff);
+  const __m512i one = _mm512_set1_epi32(0x00010101);
+  size_t i;
+  for (i = 0; i + 16 <= n; i += 16) {
+    __m512i v = _mm512_loadu_si512((void *) (p + i));
+    _mm512_storeu_si512((void *) (p + i), _mm512_subs_epu8(_mm512_and_si512(v, mask), one));
+  }
+  fade_span_dec(p + i, n - i);
+}
+#elif defined(__ARM_NEON)
+static void fade_span_neon(uint32_t *p, size_t n) {
+  const uint32x4_t mask = vdupq_n_u32(0x00ffffff);
+  const uint8x16_t one = vreinterpretq_u8_u32(vdupq_n_u32(0x00010101));
+  size_t i;
+  for (i = 0; i + 4 <= n; i += 4) {
+    uint8x16_t v = vreinterpretq_u8_u32(vandq_u32(vld1q_u32(p + i), mask));
+    vst1q_u32(p + i, vreinterpretq_u32_u8(vqsubq_u8(v, one)));
+  }
+  fade_span_dec(p + i, n - i);
+}
+#endif
+
+static void setup_fade(double factor) {
+  int c;
+  int dec = 1;
+
+  for (c = 0; c < 256; c++) {
+    fade_lut[c] = (int) c * factor;
+    if (fade_lut[c] != (c ? c - 1 : 0)) dec = 0;
+  }
+
+  fade_decrements = dec;
+  fade_span = fade_span_lut;
+  fade_resolve = fade_resolve_scalar;
+  fade_present = fade_present_lut;
+  if (dec) {
+    fade_span = fade_span_dec;
+    fade_present = fade_present_dec;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    fade_span = fade_span_sse2;
+    if (__builtin_cpu_supports("avx2")) {
+      fade_span = fade_span_avx2;
+      fade_resolve = fade_resolve_avx2;
+      fade_present = fade_present_avx2;
+    }
+    if (__builtin_cpu_supports("avx512bw")) {
+      fade_span = fade_span_avx512;
+      fade_present = fade_present_avx512;
+    }
+#elif defined(__ARM_NEON)
+    fade_span = fade_span_neon;
+#endif
+  }
+}
+
+#endif
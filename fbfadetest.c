@@ -0,0 +1,105 @@
+/* gcc -O3 -o fbfadetest fbfadetest.c
+ *
+ * Checks every fade kernel in fbfade.h that the CPU can run against
+ * the scalar fade the demos are written with,
+ *
+ *   R = (int) R * FADE_FACTOR;   and the same for G and B
+ *
+ * for every 24-bit colour, with junk in the top byte, from a start
+ * that isn't aligned for any of the vector widths. Exits nonzero at
+ * the first colour that comes out different.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "fbfade.h"
+
+#define N_COLOURS (1 << 24)
+
+static struct kernel {
+  const char *name;
+  void (*span)(uint32_t *p, size_t n);
+  void (*present)(uint32_t *dst, uint32_t *src, size_t n);
+  int dec;      /* only for factors that take one off each channel */
+  int ok;       /* the CPU can run it */
+} kernels[] = {
+  { "lut", fade_span_lut, fade_present_lut, 0, 1 },
+  { "dec", fade_span_dec, fade_present_dec, 1, 1 },
+#if defined(__x86_64__) || defined(__i386__)
+  { "sse2", fade_span_sse2, NULL, 1, 0 },
+  { "avx2", fade_span_avx2, fade_present_avx2, 1, 0 },
+  { "avx512", fade_span_avx512, fade_present_avx512, 1, 0 },
+#elif defined(__ARM_NEON)
+  { "neon", fade_span_neon, NULL, 1, 1 },
+#endif
+};
+
+#define N_KERNELS (int) (sizeof(kernels) / sizeof(kernels[0]))
+
+static double factors[] = { 0.999, 0.9 };
+
+static uint32_t fade_expected(uint32_t p, double factor) {
+  int R = (p >> 16) & 0xff;
+  int G = (p >> 8) & 0xff;
+  int B = p & 0xff;
+  R = (int) R * factor;
+  G = (int) G * factor;
+  B = (int) B * factor;
+  return (R << 16) | (G << 8) | B;
+}
+
+static uint32_t colour(uint32_t c) {
+  return c | ((c * 2654435761u) & 0xff000000);
+}
+
+static int check(const char *kernel, const char *what, double factor, uint32_t *got, int faded) {
+  uint32_t c;
+  for (c = 0; c < N_COLOURS; c++) {
+    uint32_t want = faded ? fade_expected(colour(c), factor) : colour(c);
+    if (got[c] != want) {
+      fprintf(stderr, "fade %g, %s %s: %08x came out %08x, not %08x\n",
+	      factor, kernel, what, colour(c), got[c], want);
+      return 0;
+    }
+  }
+  return 1;
+}
+
+int main(void) {
+  /* one pixel in, so that no vector width lines up */
+  uint32_t *src = (uint32_t *) malloc((N_COLOURS + 1) * sizeof(uint32_t)) + 1;
+  uint32_t *dst = (uint32_t *) malloc((N_COLOURS + 1) * sizeof(uint32_t)) + 1;
+  int failed = 0;
+  int f, k;
+  uint32_t c;
+
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  kernels[2].ok = __builtin_cpu_supports("sse2");
+  kernels[3].ok = __builtin_cpu_supports("avx2");
+  kernels[4].ok = __builtin_cpu_supports("avx512bw");
+#endif
+
+  for (f = 0; f < (int) (sizeof(factors) / sizeof(factors[0])); f++) {
+    setup_fade(factors[f]);
+    for (k = 0; k < N_KERNELS; k++) {
+      int ok = 1;
+      if (!kernels[k].ok || (kernels[k].dec && !fade_decrements)) continue;
+
+      for (c = 0; c < N_COLOURS; c++) src[c] = colour(c);
+      kernels[k].span(src, N_COLOURS);
+      ok &= check(kernels[k].name, "span", factors[f], src, 1);
+
+      if (kernels[k].present) {
+	for (c = 0; c < N_COLOURS; c++) src[c] = colour(c);
+	kernels[k].present(dst, src, N_COLOURS);
+	ok &= check(kernels[k].name, "present, screen", factors[f], dst, 0);
+	ok &= check(kernels[k].name, "present, left behind", factors[f], src, 1);
+      }
+      printf("fade %g, %s: %s\n", factors[f], kernels[k].name, ok ? "ok" : "FAILED");
+      if (!ok) failed = 1;
+    }
+  }
+  return failed;
+}
@@ -1,25 +1,37 @@
 /* gcc -arch i386 -O3 -o fbflow fbflow.c -framework ApplicationServices -framework Carbon
+ * gcc -O3 -o fbflow fbflow.c -lm    (elsewhere; see fbscreen.h)
  */
 #include <stdint.h>
 #include <stdlib.h>
 #include <sys/time.h>
 #include <unistd.h>
+#include <string.h>
+#include <math.h>
+#include <stdio.h>
 
-#include <ApplicationServices/ApplicationServices.h>
+#include "fbscreen.h"
+#include "fbpace.h"
+#include "fbbench.h"
+#include "fbfade.h"
+#include "fbpool.h"
+#include "fbrand.h"
+#include "fbarena.h"
 
-static struct screen {
-  uint32_t *base;
-  uint32_t *shadow;
-  int width;
-  int height;
-  int stride;
-} screen;
+#define TARGET_FPS 75
 
-#define N_PARTICLES 50000
+#define N_PARTICLES 50000   /* the default; FBFLOW_PARTICLES=n picks another */
 #define ERASE_TRACKS 0
 #define WANT_FADE 1
+#define WANT_TRAILS 0    /* erase each particle's trail TRAIL_LENGTH frames behind it, instead of fading */
 #define WANT_REPLACEMENTS 0
 
+#define TRAIL_LENGTH 16
+#define TRAIL_DIM 8      /* and dim it this many frames behind; 0 for never */
+
+#if WANT_TRAILS && (WANT_FADE || ERASE_TRACKS)
+#error "WANT_TRAILS replaces WANT_FADE and ERASE_TRACKS"
+#endif
+
 #define FADE_FACTOR 0.999
 
 #define N_MASSES 2
@@ -34,7 +46,9 @@ static struct screen {
 
 static struct particle {
   float x, y, vx, vy;
-} particles[N_PARTICLES];
+} *particles;
+
+static int n_particles;
 
 static struct mass {
   float x, y;
@@ -47,31 +61,111 @@ static uint32_t colors[MAX_COLOR];
 
 static int frame_counter = 0;
 
-static void setup_screen(void) {
-  CGDirectDisplayID targetDisplay = kCGDirectMainDisplay;
+#if WANT_TRAILS
+/* Where each particle was drawn in each of the last TRAIL_LENGTH
+   frames, as (y << 16) | x, or -1 for nowhere, and in what colour.
+   Frame f uses slot f % TRAIL_LENGTH, so the slot about to be filled
+   holds the point that has just expired, and a frame's work is one
+   pass along two rows of these. */
+static int32_t *trail_pix[TRAIL_LENGTH];
+static uint16_t *trail_col[TRAIL_LENGTH];
+
+static uint32_t dim(uint32_t c) {
+  return (c >> 1) & 0x7f7f7f;
+}
+
+static uint32_t *trail_pixel(int32_t pix) {
+  return &screen.shadow[(pix >> 16) * screen.stride + (pix & 0xffff)];
+}
+
+/* Erases particle c's expired point, and dims its point from TRAIL_DIM
+   frames ago, unless something else has been drawn there since. The
+   points are wherever the particle was back then, so most of the time
+   they have dropped out of the cache; asking for the ones a few
+   particles on hides much of the wait. */
+#define TRAIL_AHEAD 16
+
+static void trail_step(int c) {
+  int now = frame_counter % TRAIL_LENGTH;
+#if TRAIL_DIM
+  int then = (frame_counter + TRAIL_LENGTH - TRAIL_DIM) % TRAIL_LENGTH;
+#endif
+  int32_t pix = trail_pix[now][c];
+
+  if (c + TRAIL_AHEAD < n_particles) {
+    if (trail_pix[now][c + TRAIL_AHEAD] >= 0) __builtin_prefetch(trail_pixel(trail_pix[now][c + TRAIL_AHEAD]), 1);
+#if TRAIL_DIM
+    if (trail_pix[then][c + TRAIL_AHEAD] >= 0) __builtin_prefetch(trail_pixel(trail_pix[then][c + TRAIL_AHEAD]), 1);
+#endif
+  }
 
-  CGDisplayCapture(targetDisplay); /* crucial for being permitted to write on it */
-  screen.base = (uint32_t *) CGDisplayBaseAddress(targetDisplay);
-  screen.stride = CGDisplayBytesPerRow(targetDisplay) / sizeof(uint32_t);
-  screen.width = CGDisplayPixelsWide(targetDisplay);
-  screen.height = CGDisplayPixelsHigh(targetDisplay);
-  screen.shadow = malloc(screen.stride * screen.height * sizeof(uint32_t));
+  if (pix >= 0) {
+    uint32_t *p = trail_pixel(pix);
+    uint32_t col = colors[trail_col[now][c]];
+    if (*p == col || *p == dim(col)) {
+      *p = 0;
+      damage(pix & 0xffff, pix & 0xffff, pix >> 16);
+    }
+    trail_pix[now][c] = -1;
+  }
+#if TRAIL_DIM
+  pix = trail_pix[then][c];
+  if (pix >= 0) {
+    uint32_t *p = trail_pixel(pix);
+    uint32_t col = colors[trail_col[then][c]];
+    if (*p == col) {
+      *p = dim(col);
+      damage(pix & 0xffff, pix & 0xffff, pix >> 16);
+    }
+  }
+#endif
 }
 
-static void init_particle(struct particle *p) {
-  p->x = random() % screen.width;
-  p->y = random() % screen.height;
-  p->vx = (float)(random() % 200) / 100 - 1;
-  p->vy = (float)(random() % 200) / 100 - 1;
+static void setup_trails(void) {
+  int i;
+  for (i = 0; i < TRAIL_LENGTH; i++) {
+    trail_pix[i] = malloc(n_particles * sizeof(int32_t));
+    trail_col[i] = malloc(n_particles * sizeof(uint16_t));
+    if (!trail_pix[i] || !trail_col[i]) {
+      perror("malloc");
+      exit(1);
+    }
+    memset(trail_pix[i], 0xff, n_particles * sizeof(int32_t));
+  }
+}
+#endif
+
+/* See lflow.c: each particle has its own numbers in each generation. */
+static void init_particle(struct particle *p, int generation) {
+  struct rng r = rand_stream(RAND_PARTICLES + generation);
+  rand_seek(&r, (uint64_t) (p - particles) * 4);
+  p->x = rand_below(&r, screen.width);
+  p->y = rand_below(&r, screen.height);
+  p->vx = (float) rand_below(&r, 200) / 100 - 1;
+  p->vy = (float) rand_below(&r, 200) / 100 - 1;
   p->vx *= VEL_SCALE;
   p->vy *= VEL_SCALE;
 }
 
+static void init_particles(int i, int n) {
+  int per = (n_particles + n - 1) / n;
+  int c;
+  for (c = i * per; c < MIN((i + 1) * per, n_particles); c++) {
+    init_particle(&particles[c], 0);
+  }
+}
+
 static void setup_particles(void) {
-  int i;
-  for (i = 0; i < N_PARTICLES; i++) {
-    init_particle(&particles[i]);
+  const char *s = getenv("FBFLOW_PARTICLES");
+
+  n_particles = s ? atoi(s) : N_PARTICLES;
+  if (n_particles < 1) {
+    fprintf(stderr, "FBFLOW_PARTICLES=%s makes no sense\n", s);
+    exit(1);
   }
+  /* mmap hands out whole pages, so the array starts on a cache line */
+  particles = arena_alloc(n_particles * sizeof(struct particle));
+  pool_run(init_particles);
 }
 
 static int mkcolor(int R, int G, int B) {
@@ -90,46 +184,31 @@ static void setup_colors(void) {
   }
 }
 
-static void clrscr(void) {
-  memset(screen.shadow,
-	 0,
-	 ((screen.height-1) * screen.stride + screen.width) * sizeof(uint32_t));
-}
-
-static void putpixel(int x, int y, int c) {
-  screen.shadow[y * screen.stride + x] = c;
-}
-
-static int getpixel(int x, int y) {
-  return screen.shadow[y * screen.stride + x];
-}
-
 static void do_frame() {
   Point loc;
-  int x, y, c;
+#if WANT_FADE
+  int y;
+#endif
+  int c;
+  TRACE_SCOPE("do_frame");
 
-  GetMouse(&loc);
+  input_mouse(&loc);
 
   if (frame_counter == 0) {
     clrscr();
   } else {
 
 #if WANT_FADE
+    bench_begin(PHASE_FADE);
     for (y = 0; y < screen.height; y++) {
-      for (x = 0; x < screen.width; x++) {
-	int p = getpixel(x, y);
-	if (p) {
-	  int R = (p >> 16) & 0xff;
-	  int G = (p >> 8) & 0xff;
-	  int B = p & 0xff;
-	  R = (int) R * FADE_FACTOR;
-	  G = (int) G * FADE_FACTOR;
-	  B = (int) B * FADE_FACTOR;
-	  p = (R << 16) | (G << 8) | B;
-	  putpixel(x, y, p);
-	}
+      int lo = screen.used_lo[y];
+      int hi = screen.used_hi[y];
+      if (lo <= hi) {
+	fade_span(&screen.shadow[y * screen.stride + lo], hi - lo + 1);
+	damage(lo, hi, y);
       }
     }
+    bench_end(PHASE_FADE);
 #endif
 
     masses[0].x = loc.h;
@@ -140,13 +219,17 @@ static void do_frame() {
     masses[1].y = screen.height - loc.v;
     masses[1].mass = M2;
 
-    for (c = 0; c < N_PARTICLES; c++) {
+    bench_begin(PHASE_PHYSICS);
+    for (c = 0; c < n_particles; c++) {
       struct particle *p = &particles[c];
       int bodynum;
       int color_index;
       float oldx = p->x;
       float oldy = p->y;
 
+#if WANT_TRAILS
+      trail_step(c);
+#endif
 #if !WANT_REPLACEMENTS
       if (oldx == DEAD_PARTICLE_MARKER)
 	continue;
@@ -161,7 +244,7 @@ static void do_frame() {
 	float dvy = k * dy;
 	if (m < MASS_CLIP) {
 #if WANT_REPLACEMENTS
-	  init_particle(p);
+	  init_particle(p, frame_counter);
 #else
 	  p->x = DEAD_PARTICLE_MARKER;
 #endif
@@ -173,6 +256,7 @@ static void do_frame() {
 
       color_index = sqrt(p->vx * p->vx + p->vy * p->vy) * 200;
       if (color_index > MAX_COLOR) color_index = MAX_COLOR;
+      if (color_index < 1) color_index = 1; /* stay inside colors[] when stopped dead */
       color_index = MAX_COLOR - color_index;
 
       p->x = p->x + p->vx;
@@ -180,13 +264,17 @@ static void do_frame() {
       if ((p->x < 0) || (p->y < 0) || (p->x >= screen.width) || (p->y >= screen.height)) {
 	if ((p->x < -screen.width) || (p->y < -screen.height) || (p->x >= screen.width * 2) || (p->y > screen.height * 2)) {
 #if WANT_REPLACEMENTS
-	  init_particle(p);
+	  init_particle(p, frame_counter);
 #else
 	  p->x = DEAD_PARTICLE_MARKER;
 #endif
 	}
       } else {
 	putpixel(p->x, p->y, colors[color_index]);
+#if WANT_TRAILS
+	trail_pix[frame_counter % TRAIL_LENGTH][c] = ((int) p->y << 16) | (int) p->x;
+	trail_col[frame_counter % TRAIL_LENGTH][c] = color_index;
+#endif
       }
     done_particle:
 #if ERASE_TRACKS
@@ -196,44 +284,52 @@ static void do_frame() {
 #endif
       continue;
     }
+    bench_end(PHASE_PHYSICS);
   }
 }
 
 int main(int argc, char *argv[]) {
   struct timeval t_start, t_stop;
+  struct pacer pacer;
+
+  bench_parse_args(argc, argv);
+  rand_setup(bench_seed());
 
-  setup_screen();
+  setup_screen(SCREEN_SHADOW);
   setup_colors();
+  setup_fade(FADE_FACTOR);
+  pool_start();
   setup_particles();
+#if WANT_TRAILS
+  setup_trails();
+#endif
 
   gettimeofday(&t_start, NULL);
+  pacer_start(&pacer, bench_fps(TARGET_FPS));
+  bench_start();
 
-  srandom(time(NULL));
 
   frame_counter = 0;
-  while (!Button()) {
+  while (bench_running(frame_counter) && !input_button()) {
     do_frame();
-    memcpy(screen.base, screen.shadow, screen.stride * screen.height * sizeof(uint32_t));
+    bench_begin(PHASE_PRESENT);
+    screen_present();
+    bench_end(PHASE_PRESENT);
+    bench_frame_done(frame_counter);
     frame_counter++;
 
-    {
-      struct timeval t_now;
-      gettimeofday(&t_now, NULL);
-      useconds_t d = (t_now.tv_sec - t_start.tv_sec) * 1000000 + (t_now.tv_usec - t_start.tv_usec);
-      long nap = frame_counter * (1000000 / 75) - d;
-      if (nap > 0) {
-	usleep(nap);
-      }
-    }
+    pacer_wait(&pacer);
   }
 
   gettimeofday(&t_stop, NULL);
 
   {
     long delta = (t_stop.tv_sec - t_start.tv_sec) * 1000000 + (t_stop.tv_usec - t_start.tv_usec);
-    printf("%d frames took %lu microseconds, so %g frames/sec\n",
+    fprintf(bench.log, "%d frames took %lu microseconds, so %g frames/sec\n",
 	   frame_counter,
 	   delta,
 	   frame_counter / (delta / 1000000.0));
+    pacer_report(&pacer, bench.log);
+    bench_report(&pacer);
   }
 }
@@ -8,6 +8,8 @@
 
 #include <ApplicationServices/ApplicationServices.h>
 
+#include "fbrand.h"
+
 static struct screen {
   uint32_t *base;
   uint32_t *shadow;
@@ -66,8 +68,10 @@ static double *height_at(int x, int y) {
   return &heights[(y % terrain_length) * terrain_length + (x % terrain_length)];
 }
 
-static double skew(double variation) {
-  return (random() % 1001 - 500) * variation / 1000;
+static double skew(double variation, int x, int y) {
+  struct rng r = rand_stream(RAND_TERRAIN);
+  rand_seek(&r, (uint64_t) y * terrain_length + x);
+  return ((int) rand_below(&r, 1001) - 500) * variation / 1000;
 }
 
 static double lerp(double a, double b, double r) {
@@ -92,12 +96,12 @@ static void subdivide(int left, int top, int len, double variation, int R, int B
   int newlen = len / 2 + 1;
 
   if (len > 2) {
-    /*  */ *tm = lerp(*tl, *tr, 0.5) + skew(variation);
-    if (B) *bm = lerp(*bl, *br, 0.5) + skew(variation);
-    /*  */ *ml = lerp(*tl, *bl, 0.5) + skew(variation);
-    if (R) *mr = lerp(*tr, *br, 0.5) + skew(variation);
+    /*  */ *tm = lerp(*tl, *tr, 0.5) + skew(variation, midx, top);
+    if (B) *bm = lerp(*bl, *br, 0.5) + skew(variation, midx, bottom);
+    /*  */ *ml = lerp(*tl, *bl, 0.5) + skew(variation, left, midy);
+    if (R) *mr = lerp(*tr, *br, 0.5) + skew(variation, right, midy);
 
-    *mm = lerp(lerp(*tl, *tr, 0.5), lerp(*bl, *br, 0.5), 0.5) + skew(variation);
+    *mm = lerp(lerp(*tl, *tr, 0.5), lerp(*bl, *br, 0.5), 0.5) + skew(variation, midx, midy);
 
     subdivide(midx, midy, newlen, newvar, R, B);
     subdivide(left, midy, newlen, newvar, 0, B);
@@ -264,7 +268,7 @@ static void do_frame(void) {
 int main(int argc, char *argv[]) {
   struct timeval t_start, t_stop;
 
-  srandom(time(NULL));
+  rand_setup(time(NULL));
 
   setup_screen();
   setup_heights();
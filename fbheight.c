@@ -1,24 +1,61 @@
 /* gcc -arch i386 -O3 -o fbheight fbheight.c -framework ApplicationServices -framework Carbon
+ * gcc -O3 -o fbheight fbheight.c -lm    (elsewhere; see fbscreen.h)
  */
 #include <stdint.h>
 #include <stdlib.h>
 #include <sys/time.h>
 #include <unistd.h>
 #include <math.h>
+#include <time.h>
+
+#include "fbscreen.h"
+#include "fbpace.h"
+#include "fbbench.h"
+#include "fbpool.h"
+#include "fbrand.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+/* Each cell of the terrain keeps its ground height and the water on
+   top of it side by side, since nearly everything that reads one reads
+   the other, of the same cell and its neighbours. They are floats
+   unless TERRAIN_DOUBLE is 1, which is plenty for heights between 0
+   and 1 and fits twice the terrain in the same cache. */
+#define TERRAIN_DOUBLE 0
+
+#if TERRAIN_DOUBLE
+typedef double terrain_t;
+#else
+typedef float terrain_t;
+#endif
+
+typedef struct cell {
+  terrain_t h;   /* ground */
+  terrain_t w;   /* water */
+} cell;
+
+/* The terrain has a halo of one cell all round, just outside 0 ..
+   terrain_length - 1, so that every cell's neighbours can be read
+   without wrapping or checking. What the halo holds depends on who is
+   reading: fill_halo() wraps it round from the far side, clamps it to
+   the nearest edge cell, or makes it a sink that water runs off into. */
+enum halo { HALO_WRAP, HALO_CLAMP, HALO_SINK };
+
+static cell *terrain;     /* cell (0, 0); the halo is before and after */
+static cell *next_terrain; /* where erode() works out the next step */
+
+/* How a wet cell's water leaves it: q of it, shared among its lower
+   neighbours in proportion to how much lower each is, out of total.
+   Cells that keep their water, and the halo, have q = 0 and total = 1. */
+typedef struct flow {
+  terrain_t q;
+  terrain_t total;
+} flow;
 
-#include <ApplicationServices/ApplicationServices.h>
-
-static struct screen {
-  uint32_t *base;
-  uint32_t *shadow;
-  int width;
-  int height;
-  int stride;
-} screen;
-
-static double *heights;
-static double *waterheights;
 static int terrain_length;
+static int terrain_stride; /* terrain_length + 2 */
 
 typedef struct vec3 {
   double x, y, z;
@@ -26,12 +63,10 @@ typedef struct vec3 {
 
 #define V3(X,Y,Z) ((vec3){ (X), (Y), (Z) })
 
-#define MAX(a, b) ((a) > (b) ? (a) : (b))
-#define MIN(a, b) ((a) > (b) ? (b) : (a))
-
 static int frame_counter = 0;
 
 static int rain = 0;
+static int showers = 0;   /* how many times it has rained */
 static int erosion = 1;
 static int isometric = 1;
 static double ambient_bright = 0.05;
@@ -39,23 +74,24 @@ static vec3 lightvec = V3(-0.5, -0.1, -0.5);
 static int vp_left = 0;
 static int vp_top = 0;
 
-#define VIEWPORT_WIDTH 256
+#define TARGET_FPS 0 /* was 75, but the sleep was turned off */
+#define VIEWPORT_WIDTH 256 /* and the terrain is one more across; FBHEIGHT_TERRAIN=n makes it n + 1 */
 #define VSCALE (terrain_length)
 #define RAINDROP_SIZE (0.00005 * VSCALE)
 #define FLOW_STEP_CHOP 0.05
 #define DISSOLVE_RATIO 10
 #define DROPS_PER_RAIN (terrain_length * terrain_length / 10)
 #define EPSILON 0.0001
-
-static void setup_screen(void) {
-  CGDirectDisplayID targetDisplay = kCGDirectMainDisplay;
-
-  CGDisplayCapture(targetDisplay); /* crucial for being permitted to write on it */
-  screen.base = (uint32_t *) CGDisplayBaseAddress(targetDisplay);
-  screen.stride = CGDisplayBytesPerRow(targetDisplay) / sizeof(uint32_t);
-  screen.width = CGDisplayPixelsWide(targetDisplay);
-  screen.height = CGDisplayPixelsHigh(targetDisplay);
-  screen.shadow = malloc(screen.stride * screen.height * sizeof(uint32_t));
+#define SINK_LEVEL 0.6 /* water runs off the edges down to this */
+#define MASS_TOLERANCE 1e-4 /* how far erosion may drift from conserving ground and water */
+
+static cell *alloc_terrain(void) {
+  cell *cs = malloc(terrain_stride * terrain_stride * sizeof(cell));
+  if (!cs) {
+    perror("malloc");
+    exit(1);
+  }
+  return cs + terrain_stride + 1;
 }
 
 static void setup_heights(void) {
@@ -64,25 +100,65 @@ static void setup_heights(void) {
   /*   terrain_length = terrain_length << 1; */
   /* } */
   /* terrain_length++; */
-  terrain_length = VIEWPORT_WIDTH + 1;
-  heights = malloc(terrain_length * terrain_length * sizeof(double));
-  waterheights = malloc(terrain_length * terrain_length * sizeof(double));
+  const char *s = getenv("FBHEIGHT_TERRAIN");
+  int n = s ? atoi(s) : VIEWPORT_WIDTH;
+
+  if (n < VIEWPORT_WIDTH) {
+    fprintf(stderr, "FBHEIGHT_TERRAIN=%s makes no sense\n", s);
+    exit(1);
+  }
+  /* subdivide() wants a power of two, plus one */
+  terrain_length = VIEWPORT_WIDTH;
+  while (terrain_length < n) terrain_length <<= 1;
+  terrain_length++;
+  terrain_stride = terrain_length + 2;
+  terrain = alloc_terrain();
+  next_terrain = alloc_terrain();
 }
 
-static double *height_at1(double *hs, int x, int y) {
-  return &hs[(y % terrain_length) * terrain_length + (x % terrain_length)];
+/* -1 <= x, y <= terrain_length */
+static cell *cell_at1(cell *cs, int x, int y) {
+  return &cs[y * terrain_stride + x];
 }
 
-static double *height_at(int x, int y) {
-  return height_at1(heights, x, y);
+static terrain_t *height_at(int x, int y) {
+  return &cell_at1(terrain, x, y)->h;
 }
 
-static double *waterheight_at(int x, int y) {
-  return height_at1(waterheights, x, y);
+static terrain_t *waterheight_at(int x, int y) {
+  return &cell_at1(terrain, x, y)->w;
 }
 
-static double skew(double variation) {
-  return (random() % 1001 - 500) * variation / 1000;
+static cell halo_cell(cell *cs, enum halo policy, int x, int y) {
+  int n = terrain_length;
+  cell sink = { SINK_LEVEL, 0 };
+  switch (policy) {
+  case HALO_WRAP:
+    return *cell_at1(cs, (x + n) % n, (y + n) % n);
+  case HALO_CLAMP:
+    return *cell_at1(cs, MIN(MAX(x, 0), n - 1), MIN(MAX(y, 0), n - 1));
+  default:
+    return sink;
+  }
+}
+
+static void fill_halo(cell *cs, enum halo policy) {
+  int n = terrain_length;
+  int i;
+  for (i = -1; i <= n; i++) {
+    *cell_at1(cs, i, -1) = halo_cell(cs, policy, i, -1);
+    *cell_at1(cs, i, n) = halo_cell(cs, policy, i, n);
+    *cell_at1(cs, -1, i) = halo_cell(cs, policy, -1, i);
+    *cell_at1(cs, n, i) = halo_cell(cs, policy, n, i);
+  }
+}
+
+/* Each point of the terrain has its own random number, so the terrain
+   depends only on the seed, not on the order it is made in. */
+static double skew(double variation, int x, int y) {
+  struct rng r = rand_stream(RAND_TERRAIN);
+  rand_seek(&r, (uint64_t) y * terrain_length + x);
+  return ((int) rand_below(&r, 1001) - 500) * variation / 1000;
 }
 
 static double lerp(double a, double b, double r) {
@@ -94,25 +170,25 @@ static void subdivide(int left, int top, int len, double variation, int R, int B
   int bottom = top + len - 1;
   int midx = left + len / 2;
   int midy = top + len / 2;
-  double *tl = height_at(left, top);
-  double *tm = height_at(midx, top);
-  double *tr = height_at(right, top);
-  double *ml = height_at(left, midy);
-  double *mm = height_at(midx, midy);
-  double *mr = height_at(right, midy);
-  double *bl = height_at(left, bottom);
-  double *bm = height_at(midx, bottom);
-  double *br = height_at(right, bottom);
+  terrain_t *tl = height_at(left, top);
+  terrain_t *tm = height_at(midx, top);
+  terrain_t *tr = height_at(right, top);
+  terrain_t *ml = height_at(left, midy);
+  terrain_t *mm = height_at(midx, midy);
+  terrain_t *mr = height_at(right, midy);
+  terrain_t *bl = height_at(left, bottom);
+  terrain_t *bm = height_at(midx, bottom);
+  terrain_t *br = height_at(right, bottom);
   double newvar = variation / 1.9;
   int newlen = len / 2 + 1;
 
   if (len > 2) {
-    /*  */ *tm = lerp(*tl, *tr, 0.5) + skew(variation);
-    if (B) *bm = lerp(*bl, *br, 0.5) + skew(variation);
-    /*  */ *ml = lerp(*tl, *bl, 0.5) + skew(variation);
-    if (R) *mr = lerp(*tr, *br, 0.5) + skew(variation);
+    /*  */ *tm = lerp(*tl, *tr, 0.5) + skew(variation, midx, top);
+    if (B) *bm = lerp(*bl, *br, 0.5) + skew(variation, midx, bottom);
+    /*  */ *ml = lerp(*tl, *bl, 0.5) + skew(variation, left, midy);
+    if (R) *mr = lerp(*tr, *br, 0.5) + skew(variation, right, midy);
 
-    *mm = lerp(lerp(*tl, *tr, 0.5), lerp(*bl, *br, 0.5), 0.5) + skew(variation);
+    *mm = lerp(lerp(*tl, *tr, 0.5), lerp(*bl, *br, 0.5), 0.5) + skew(variation, midx, midy);
 
     subdivide(midx, midy, newlen, newvar, R, B);
     subdivide(left, midy, newlen, newvar, 0, B);
@@ -121,20 +197,6 @@ static void subdivide(int left, int top, int len, double variation, int R, int B
   }
 }
 
-static void clrscr(void) {
-  memset(screen.shadow,
-	 0,
-	 ((screen.height-1) * screen.stride + screen.width) * sizeof(uint32_t));
-}
-
-static void putpixel(int x, int y, int c) {
-  screen.shadow[y * screen.stride + x] = c;
-}
-
-static int getpixel(int x, int y) {
-  return screen.shadow[y * screen.stride + x];
-}
-
 static int mkcolor(int R, int G, int B) {
   return (R << 16) | (G << 8) | B;
 }
@@ -168,9 +230,8 @@ static vec3 norm(vec3 v) {
   }
 }
 
+/* Wants the halo clamped. */
 static vec3 normal_at(int x, int y) {
-  if (x >= terrain_length - 1) x = terrain_length - 2;
-  if (y >= terrain_length - 1) y = terrain_length - 2;
   double h = *height_at(x, y) + *waterheight_at(x, y);
   double hx = *height_at(x + 1, y) + *waterheight_at(x + 1, y);
   double hy = *height_at(x, y + 1) + *waterheight_at(x, y + 1);
@@ -232,72 +293,476 @@ static void iso_putpixel1(int x, int y, double hh, int c) {
 static int xoffsets[8] = { 1, 1, 0, -1, -1, -1, 0, 1 };
 static int yoffsets[8] = { 0, -1, -1, -1, 0, 1, 1, 1 };
 
+/* What erosion should leave alone: the ground and water on the map,
+   plus what has run off the edges, less what has rained since, stay
+   what they were. Checked every frame when benchmarking. */
+static struct budget {
+  double ground, water;         /* on the map to begin with */
+  double rain;                  /* added since */
+  double ground_lost, water_lost; /* run off the edges */
+  double worst;                 /* the largest drift seen, relative to the total */
+} budget;
+
+static void terrain_totals(double *ground, double *water) {
+  int x, y;
+  *ground = *water = 0;
+  for (y = 0; y < terrain_length; y++) {
+    for (x = 0; x < terrain_length; x++) {
+      *ground += cell_at1(terrain, x, y)->h;
+      *water += cell_at1(terrain, x, y)->w;
+    }
+  }
+}
+
+static void start_budget(void) {
+  terrain_totals(&budget.ground, &budget.water);
+  budget.rain = budget.ground_lost = budget.water_lost = 0;
+}
+
+static void check_budget(void) {
+  double ground, water, drift;
+
+  terrain_totals(&ground, &water);
+  drift = fabs(ground + budget.ground_lost - budget.ground) / budget.ground;
+  drift = MAX(drift, fabs(water + budget.water_lost - budget.water - budget.rain)
+	      / MAX(budget.water + budget.rain, EPSILON));
+  budget.worst = MAX(budget.worst, drift);
+  bench_stat("mass_drift", drift);
+}
+
+/* Erosion goes over the terrain in bands of rows, one per thread. Each
+   row goes through two passes: the first works out each cell's flow;
+   the second has each cell take in what flows to it from its
+   neighbours and give up its own, into the next terrain. The second
+   needs the flows of the rows either side, so a band keeps the flows
+   of just three rows, working out the next as it finishes with the
+   last; the rows either side of the band are worked out by both bands
+   that need them. No cell is written by more than one thread, and each
+   adds up its flows in the same order however the rows are shared out,
+   so the result doesn't depend on the number of threads. */
+
+static int neighbours[8];   /* offsets in the terrain, in xoffsets' order */
+static int sources[8];      /* the same, row by row, the order scattering from each used to go */
+/* which of the three rows of flows, and where in it, each source is */
+static const int source_row[8] = { 0, 0, 0, 1, 1, 2, 2, 2 };
+static const int source_dx[8] = { -1, 0, 1, -1, 1, -1, 0, 1 };
+
+static flow *band_flows;    /* three rows for each thread */
+static flow *dry_flows;     /* the flows of the halo rows */
+static double *row_ground_lost, *row_water_lost; /* off the edges, by row */
+
+/* For the erosion kernels, which must round the same; see below. */
+#define EXACT __attribute__((optimize("fp-contract=off")))
+
+/* d if it is positive, else 0. Written as a comparison, the compiler
+   makes it a branch, which goes whichever way the terrain does. */
+EXACT static terrain_t downhill(terrain_t d) {
+#if TERRAIN_DOUBLE
+  return (d + fabs(d)) * 0.5;
+#else
+  return (d + fabsf(d)) * 0.5f;
+#endif
+}
+
+/* The two passes go a row at a time, through one of these kernels:
+   n cells from row, their flows at f, and the next terrain at out;
+   gathering, f has the flows of the rows before, of and after row.
+   The scalar ones are the reference, and the ones used when the CPU
+   has nothing better; the others give the same results to the bit,
+   which bench_erosion() and fbheighttest check.
+
+   What makes them the same is that every kernel does the same
+   operations in the same order, each rounded on its own: GCC would
+   otherwise fuse a multiply and an add into an FMA wherever the
+   target has one, and where it does so differs between kernels, and
+   between -march settings. So the kernels, and everything they call,
+   are built with fp-contract=off, whatever the flags. */
+EXACT static void find_flows_scalar(cell *row, flow *f, int n) {
+  int x, k;
+  for (x = 0; x < n; x++) {
+    terrain_t wh = row[x].w;
+    terrain_t hh = row[x].h;
+    terrain_t total = 0;
+    for (k = 0; k < 8; k++) {
+      cell *c = &row[x + neighbours[k]];
+      terrain_t d = (wh + hh) - (c->w + c->h);
+      total += downhill(d);
+    }
+    if (wh > EPSILON && total > 0) {
+      f[x].q = wh * (terrain_t) FLOW_STEP_CHOP;
+      f[x].total = total;
+    } else {
+      f[x].q = 0;
+      f[x].total = 1;
+    }
+  }
+}
+
+EXACT static void gather_flows_scalar(cell *row, flow **f, cell *out, int n) {
+  int x, k;
+  for (x = 0; x < n; x++) {
+    terrain_t here = row[x].w + row[x].h;
+    terrain_t h = row[x].h;
+    terrain_t w = row[x].w;
+    for (k = 0; k < 8; k++) {
+      cell *c = &row[x + sources[k]];
+      flow *from = &f[source_row[k]][x + source_dx[k]];
+      terrain_t d = (c->w + c->h) - here;
+      terrain_t share = from->q * downhill(d) / from->total;
+      if (k == 4) {
+	h -= f[1][x].q * DISSOLVE_RATIO;
+	w -= f[1][x].q;
+      }
+      h += share * DISSOLVE_RATIO;
+      w += share;
+    }
+    out[x].h = h;
+    out[x].w = w;
+  }
+}
+
+#if (defined(__x86_64__) || defined(__i386__)) && !TERRAIN_DOUBLE
+/* Cells and flows are both pairs of floats; these load 8 of them as
+   two vectors of their first and second halves, and store them back.
+   The vector kernels do the scalar ones' sums in the same order, and
+   take max(d, 0) for downhill(), which gives the same answer. */
+__attribute__((target("avx2"), optimize("fp-contract=off")))
+static void split8(const void *p, __m256 *a, __m256 *b) {
+  __m256 lo = _mm256_loadu_ps((const float *) p);
+  __m256 hi = _mm256_loadu_ps((const float *) p + 8);
+  *a = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(_mm256_shuffle_ps(lo, hi, _MM_SHUFFLE(2, 0, 2, 0))), 0xd8));
+  *b = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(_mm256_shuffle_ps(lo, hi, _MM_SHUFFLE(3, 1, 3, 1))), 0xd8));
+}
+
+__attribute__((target("avx2"), optimize("fp-contract=off")))
+static void join8(void *p, __m256 a, __m256 b) {
+  __m256 lo = _mm256_unpacklo_ps(a, b);
+  __m256 hi = _mm256_unpackhi_ps(a, b);
+  _mm256_storeu_ps((float *) p, _mm256_permute2f128_ps(lo, hi, 0x20));
+  _mm256_storeu_ps((float *) p + 8, _mm256_permute2f128_ps(lo, hi, 0x31));
+}
+
+__attribute__((target("avx2"), optimize("fp-contract=off")))
+static void find_flows_avx2(cell *row, flow *f, int n) {
+  const __m256 zero = _mm256_setzero_ps();
+  const __m256 one = _mm256_set1_ps(1);
+  const __m256 epsilon = _mm256_set1_ps(EPSILON);
+  const __m256 chop = _mm256_set1_ps(FLOW_STEP_CHOP);
+  int x, k;
+  for (x = 0; x + 8 <= n; x += 8) {
+    __m256 hh, wh, level, wet;
+    __m256 total = zero;
+    split8(row + x, &hh, &wh);
+    level = _mm256_add_ps(wh, hh);
+    for (k = 0; k < 8; k++) {
+      __m256 h1, w1;
+      split8(row + x + neighbours[k], &h1, &w1);
+      total = _mm256_add_ps(total, _mm256_max_ps(_mm256_sub_ps(level, _mm256_add_ps(w1, h1)), zero));
+    }
+    wet = _mm256_and_ps(_mm256_cmp_ps(wh, epsilon, _CMP_GT_OQ), _mm256_cmp_ps(total, zero, _CMP_GT_OQ));
+    join8(f + x, _mm256_and_ps(wet, _mm256_mul_ps(wh, chop)), _mm256_blendv_ps(one, total, wet));
+  }
+  find_flows_scalar(row + x, f + x, n - x);
+}
+
+__attribute__((target("avx2"), optimize("fp-contract=off")))
+static void gather_flows_avx2(cell *row, flow **f, cell *out, int n) {
+  const __m256 zero = _mm256_setzero_ps();
+  const __m256 ratio = _mm256_set1_ps(DISSOLVE_RATIO);
+  int x, k;
+  for (x = 0; x + 8 <= n; x += 8) {
+    __m256 h, w, here;
+    split8(row + x, &h, &w);
+    here = _mm256_add_ps(w, h);
+    for (k = 0; k < 8; k++) {
+      __m256 h1, w1, q, total, share;
+      if (k == 4) {
+	split8(f[1] + x, &q, &total);
+	h = _mm256_sub_ps(h, _mm256_mul_ps(q, ratio));
+	w = _mm256_sub_ps(w, q);
+      }
+      split8(row + x + sources[k], &h1, &w1);
+      split8(f[source_row[k]] + x + source_dx[k], &q, &total);
+      share = _mm256_div_ps(_mm256_mul_ps(q, _mm256_max_ps(_mm256_sub_ps(_mm256_add_ps(w1, h1), here), zero)), total);
+      h = _mm256_add_ps(h, _mm256_mul_ps(share, ratio));
+      w = _mm256_add_ps(w, share);
+    }
+    join8(out + x, h, w);
+  }
+  {
+    flow *g[3] = { f[0] + x, f[1] + x, f[2] + x };
+    gather_flows_scalar(row + x, g, out + x, n - x);
+  }
+}
+
+/* The same, 16 at a time. */
+__attribute__((target("avx512f"), optimize("fp-contract=off")))
+static void split16(const void *p, __m512 *a, __m512 *b) {
+  const __m512i even = _mm512_set_epi32(30, 28, 26, 24, 22, 20, 18, 16, 14, 12, 10, 8, 6, 4, 2, 0);
+  const __m512i odd = _mm512_set_epi32(31, 29, 27, 25, 23, 21, 19, 17, 15, 13, 11, 9, 7, 5, 3, 1);
+  __m512 lo = _mm512_loadu_ps(p);
+  __m512 hi = _mm512_loadu_ps((const float *) p + 16);
+  *a = _mm512_permutex2var_ps(lo, even, hi);
+  *b = _mm512_permutex2var_ps(lo, odd, hi);
+}
+
+__attribute__((target("avx512f"), optimize("fp-contract=off")))
+static void join16(void *p, __m512 a, __m512 b) {
+  const __m512i first = _mm512_set_epi32(23, 7, 22, 6, 21, 5, 20, 4, 19, 3, 18, 2, 17, 1, 16, 0);
+  const __m512i second = _mm512_set_epi32(31, 15, 30, 14, 29, 13, 28, 12, 27, 11, 26, 10, 25, 9, 24, 8);
+  _mm512_storeu_ps(p, _mm512_permutex2var_ps(a, first, b));
+  _mm512_storeu_ps((float *) p + 16, _mm512_permutex2var_ps(a, second, b));
+}
+
+__attribute__((target("avx512f"), optimize("fp-contract=off")))
+static void find_flows_avx512(cell *row, flow *f, int n) {
+  const __m512 zero = _mm512_setzero_ps();
+  const __m512 one = _mm512_set1_ps(1);
+  const __m512 epsilon = _mm512_set1_ps(EPSILON);
+  const __m512 chop = _mm512_set1_ps(FLOW_STEP_CHOP);
+  int x, k;
+  for (x = 0; x + 16 <= n; x += 16) {
+    __m512 hh, wh, level;
+    __m512 total = zero;
+    __mmask16 wet;
+    split16(row + x, &hh, &wh);
+    level = _mm512_add_ps(wh, hh);
+    for (k = 0; k < 8; k++) {
+      __m512 h1, w1, d;
+      split16(row + x + neighbours[k], &h1, &w1);
+      d = _mm512_sub_ps(level, _mm512_add_ps(w1, h1));
+      total = _mm512_add_ps(total, _mm512_maskz_mov_ps(_mm512_cmp_ps_mask(d, zero, _CMP_GT_OQ), d));
+    }
+    wet = _mm512_cmp_ps_mask(wh, epsilon, _CMP_GT_OQ) & _mm512_cmp_ps_mask(total, zero, _CMP_GT_OQ);
+    join16(f + x, _mm512_maskz_mul_ps(wet, wh, chop), _mm512_mask_blend_ps(wet, one, total));
+  }
+  find_flows_scalar(row + x, f + x, n - x);
+}
+
+__attribute__((target("avx512f"), optimize("fp-contract=off")))
+static void gather_flows_avx512(cell *row, flow **f, cell *out, int n) {
+  const __m512 zero = _mm512_setzero_ps();
+  const __m512 ratio = _mm512_set1_ps(DISSOLVE_RATIO);
+  int x, k;
+  for (x = 0; x + 16 <= n; x += 16) {
+    __m512 h, w, here;
+    split16(row + x, &h, &w);
+    here = _mm512_add_ps(w, h);
+    for (k = 0; k < 8; k++) {
+      __m512 h1, w1, q, total, d, share;
+      if (k == 4) {
+	split16(f[1] + x, &q, &total);
+	h = _mm512_sub_ps(h, _mm512_mul_ps(q, ratio));
+	w = _mm512_sub_ps(w, q);
+      }
+      split16(row + x + sources[k], &h1, &w1);
+      split16(f[source_row[k]] + x + source_dx[k], &q, &total);
+      d = _mm512_sub_ps(_mm512_add_ps(w1, h1), here);
+      share = _mm512_div_ps(_mm512_maskz_mul_ps(_mm512_cmp_ps_mask(d, zero, _CMP_GT_OQ), q, d), total);
+      h = _mm512_add_ps(h, _mm512_mul_ps(share, ratio));
+      w = _mm512_add_ps(w, share);
+    }
+    join16(out + x, h, w);
+  }
+  {
+    flow *g[3] = { f[0] + x, f[1] + x, f[2] + x };
+    gather_flows_scalar(row + x, g, out + x, n - x);
+  }
+}
+#endif
+
+static struct erosion_kernel {
+  const char *name;
+  void (*find)(cell *row, flow *f, int n);
+  void (*gather)(cell *row, flow **f, cell *out, int n);
+  int ok;       /* the CPU can run it */
+} erosion_kernels[] = {
+  { "scalar", find_flows_scalar, gather_flows_scalar, 1 },
+#if (defined(__x86_64__) || defined(__i386__)) && !TERRAIN_DOUBLE
+  { "avx2", find_flows_avx2, gather_flows_avx2, 0 },
+  { "avx512", find_flows_avx512, gather_flows_avx512, 0 },
+#endif
+};
+
+#define N_EROSION_KERNELS (int) (sizeof(erosion_kernels) / sizeof(erosion_kernels[0]))
+
+static struct erosion_kernel *erosion_kernel = &erosion_kernels[0];
+
+static void setup_erosion(void) {
+  int rows = 3 * pool.n + 1;
+  int i;
+  for (i = 0; i < 8; i++) {
+    neighbours[i] = yoffsets[i] * terrain_stride + xoffsets[i];
+    sources[i] = (source_row[i] - 1) * terrain_stride + source_dx[i];
+  }
+
+  /* The kernels only write a row's cells, so the flows either side of
+     them, like the halo rows', stay dry. */
+  band_flows = malloc(rows * terrain_stride * sizeof(flow));
+  row_ground_lost = malloc(terrain_length * sizeof(double));
+  row_water_lost = malloc(terrain_length * sizeof(double));
+  if (!band_flows || !row_ground_lost || !row_water_lost) {
+    perror("malloc");
+    exit(1);
+  }
+  for (i = 0; i < rows * terrain_stride; i++) {
+    band_flows[i].q = 0;
+    band_flows[i].total = 1;
+  }
+  band_flows++;
+  dry_flows = band_flows + 3 * pool.n * terrain_stride;
+
+#if (defined(__x86_64__) || defined(__i386__)) && !TERRAIN_DOUBLE
+  __builtin_cpu_init();
+  erosion_kernels[1].ok = __builtin_cpu_supports("avx2");
+  erosion_kernels[2].ok = __builtin_cpu_supports("avx512f");
+#endif
+  for (i = 0; i < N_EROSION_KERNELS; i++) {
+    if (erosion_kernels[i].ok) erosion_kernel = &erosion_kernels[i];
+  }
+  if (getenv("FBHEIGHT_SCALAR")) erosion_kernel = &erosion_kernels[0];
+}
+
+/* What the cell at x, y on the edge, with flows f, loses into the
+   sink halo, added to its row's losses. */
+EXACT static void edge_outflow(int x, int y, flow *f) {
+  cell *c0 = cell_at1(terrain, x, y);
+  int k;
+  for (k = 0; k < 8; k++) {
+    int x1 = x + xoffsets[k];
+    int y1 = y + yoffsets[k];
+    if (x1 < 0 || y1 < 0 || x1 >= terrain_length || y1 >= terrain_length) {
+      cell *c = cell_at1(terrain, x1, y1);
+      terrain_t d = (c0->w + c0->h) - (c->w + c->h);
+      terrain_t share = f->q * downhill(d) / f->total;
+      row_ground_lost[y] += share * DISSOLVE_RATIO;
+      row_water_lost[y] += share;
+    }
+  }
+}
+
+/* Where the flows of row y are kept by the band starting at y0, or
+   the dry ones if y is in the halo. */
+static flow *band_row(flow *window, int y0, int y) {
+  if (y < 0 || y >= terrain_length) return dry_flows;
+  return window + (y - y0 + 1) % 3 * terrain_stride;
+}
+
+static void find_row(flow *window, int y0, int y) {
+  if (y < 0 || y >= terrain_length) return;
+  erosion_kernel->find(cell_at1(terrain, 0, y), band_row(window, y0, y), terrain_length);
+}
+
+static void erode_band(int i, int n) {
+  int y0 = terrain_length * i / n;
+  int y1 = terrain_length * (i + 1) / n;
+  flow *window = band_flows + 3 * i * terrain_stride;
+  int x, y;
+
+  if (y0 == y1) return;
+  find_row(window, y0, y0 - 1);
+  find_row(window, y0, y0);
+  find_row(window, y0, y0 + 1);
+  for (y = y0; y < y1; y++) {
+    flow *f[3];
+    f[0] = band_row(window, y0, y - 1);
+    f[1] = band_row(window, y0, y);
+    f[2] = band_row(window, y0, y + 1);
+    erosion_kernel->gather(cell_at1(terrain, 0, y), f, cell_at1(next_terrain, 0, y), terrain_length);
+
+    row_ground_lost[y] = row_water_lost[y] = 0;
+    if (y == 0 || y == terrain_length - 1) {
+      for (x = 0; x < terrain_length; x++) edge_outflow(x, y, &f[1][x]);
+    } else {
+      edge_outflow(0, y, &f[1][0]);
+      edge_outflow(terrain_length - 1, y, &f[1][terrain_length - 1]);
+    }
+
+    /* into where row y - 1 was */
+    if (y + 1 < y1) find_row(window, y0, y + 2);
+  }
+}
+
+/* Times every kernel the CPU can run, on one thread, eroding the
+   terrain as it starts for a number of steps, and checks that each
+   ends up with the same terrain as the scalar one. */
+static void bench_erosion(void) {
+  int steps = MAX(1, (1 << 22) / (terrain_length * terrain_length));
+  size_t terrain_size = terrain_stride * terrain_stride * sizeof(cell);
+  cell *start = malloc(terrain_size);
+  cell *expected = malloc(terrain_length * terrain_length * sizeof(cell));
+  struct erosion_kernel *chosen = erosion_kernel;
+  int i, j, y;
+
+  memcpy(start, terrain - terrain_stride - 1, terrain_size);
+  for (i = 0; i < N_EROSION_KERNELS; i++) {
+    struct timespec t0, t1;
+    double secs;
+    int same = 1;
+
+    if (!erosion_kernels[i].ok) continue;
+    erosion_kernel = &erosion_kernels[i];
+    memcpy(terrain - terrain_stride - 1, start, terrain_size);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (j = 0; j < steps; j++) {
+      cell *t = terrain;
+      fill_halo(terrain, HALO_SINK);
+      erode_band(0, 1);
+      terrain = next_terrain;
+      next_terrain = t;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+    for (y = 0; y < terrain_length; y++) {
+      size_t row_size = terrain_length * sizeof(cell);
+      if (i == 0) {
+	memcpy(&expected[y * terrain_length], cell_at1(terrain, 0, y), row_size);
+      } else if (memcmp(&expected[y * terrain_length], cell_at1(terrain, 0, y), row_size)) {
+	same = 0;
+      }
+    }
+    fprintf(bench.log, "erosion %s: %.1f million cells/sec%s\n", erosion_kernels[i].name,
+	    (double) steps * terrain_length * terrain_length / secs / 1e6,
+	    same ? "" : ", but not the same as scalar");
+    if (!same) {
+      fprintf(stderr, "the %s erosion kernel is wrong\n", erosion_kernels[i].name);
+      exit(1);
+    }
+  }
+  memcpy(terrain - terrain_stride - 1, start, terrain_size);
+  erosion_kernel = chosen;
+  free(start);
+  free(expected);
+}
+
 static void erode(void) {
   int i, x, y;
-  size_t heights_size = terrain_length * terrain_length * sizeof(double);
-  double *newheights = malloc(heights_size);
-  double *newwater = malloc(heights_size);
-
-  memcpy(newheights, heights, heights_size);
-  memcpy(newwater, waterheights, heights_size);
+  cell *t;
 
   if (rain) {
+    struct rng r = rand_stream(RAND_RAIN + showers++);
+    TRACE_SCOPE("rain");
     for (i = 0; i < DROPS_PER_RAIN * rain; i++) {
-      x = random() % (terrain_length - 2);
-      y = random() % (terrain_length - 2);
+      x = rand_below(&r, terrain_length - 2);
+      y = rand_below(&r, terrain_length - 2);
       *waterheight_at(x, y) += RAINDROP_SIZE;
+      budget.rain += RAINDROP_SIZE;
     }
     rain = 0;
   }
 
+  fill_halo(terrain, HALO_SINK);
+  pool_run(erode_band);
+
   for (y = 0; y < terrain_length; y++) {
-    for (x = 0; x < terrain_length; x++) {
-      double wh = *waterheight_at(x, y);
-      if (wh > EPSILON) {
-	double total = 0;
-	double dh[8] = {0, 0, 0, 0, 0, 0, 0, 0};
-	double hh = *height_at(x, y);
-	double wh_share;
-	for (i = 0; i < 8; i++) {
-	  int x1 = x + xoffsets[i];
-	  int y1 = y + yoffsets[i];
-	  if (x1 >= 0 && y1 >= 0 && x1 < terrain_length && y1 < terrain_length) {
-	    double hh1 = *height_at(x1, y1);
-	    double wh1 = *waterheight_at(x1, y1);
-	    double d = (wh + hh) - (wh1 + hh1);
-	    if (d > 0) {
-	      dh[i] = d;
-	      total += d;
-	    }
-	  } else {
-	    double d = (wh + hh) - 0.6;
-	    if (d > 0) {
-	      total += d;
-	    }
-	  }
-	}
-	if (total > 0) {
-	  double q = wh * FLOW_STEP_CHOP;
-	  for (i = 0; i < 8; i++) {
-	    if (dh[i] > 0) {
-	      *height_at1(newheights, x + xoffsets[i], y + yoffsets[i]) +=
-		q * dh[i] / total * DISSOLVE_RATIO;
-	      *height_at1(newwater, x + xoffsets[i], y + yoffsets[i]) +=
-		q * dh[i] / total;
-	    }
-	  }
-	  *height_at1(newheights, x, y) -= q * DISSOLVE_RATIO;
-	  *height_at1(newwater, x, y) -= q;
-	}
-      }
-    }
+    budget.ground_lost += row_ground_lost[y];
+    budget.water_lost += row_water_lost[y];
   }
 
-  free(heights);
-  heights = newheights;
-
-  free(waterheights);
-  waterheights = newwater;
+  t = terrain;
+  terrain = next_terrain;
+  next_terrain = t;
 }
 
 static void deluge(void) {
@@ -305,6 +770,7 @@ static void deluge(void) {
   for (y = 0; y < terrain_length; y++) {
     for (x = 0; x < terrain_length; x++) {
       *waterheight_at(x, y) += RAINDROP_SIZE / 10;
+      budget.rain += RAINDROP_SIZE / 10;
     }
   }
 }
@@ -318,20 +784,24 @@ static void fresh_map(void) {
   subdivide(0, 0, terrain_length, 0.5, 1, 1);
 
   {
-    int i;
-    for (i = 0; i < terrain_length * terrain_length; i++) {
-      waterheights[i] = 0;
+    int x, y;
+    for (y = 0; y < terrain_length; y++) {
+      for (x = 0; x < terrain_length; x++) {
+	*waterheight_at(x, y) = 0;
+      }
     }
   }
+  start_budget();
 }
 
 static void do_frame(void) {
   Point loc;
   uint32_t keys[4];
   int x, y;
+  TRACE_SCOPE("do_frame");
 
-  GetMouse(&loc);
-  GetKeys(&keys[0]);
+  input_mouse(&loc);
+  input_keys(&keys[0]);
 
   if (keys[0] & 0x4000 /* e */) {
     erosion = !erosion;
@@ -362,7 +832,9 @@ static void do_frame(void) {
     vp_top = (int) ((double) loc.v * (terrain_length - VIEWPORT_WIDTH) / screen.height);
   }
 
+  bench_begin(PHASE_SHADING);
   clrscr();
+  fill_halo(terrain, HALO_CLAMP);
   if (isometric) {
     for (y = 0; y < VIEWPORT_WIDTH; y++) {
       for (x = 0; x < VIEWPORT_WIDTH; x++) {
@@ -385,19 +857,27 @@ static void do_frame(void) {
       }
     }
   }
+  bench_end(PHASE_SHADING);
 
   if (erosion) {
+    bench_begin(PHASE_EROSION);
     erode();
+    bench_end(PHASE_EROSION);
+    if (bench.on) check_budget();
   }
 }
 
 int main(int argc, char *argv[]) {
   struct timeval t_start, t_stop;
+  struct pacer pacer;
 
-  srandom(time(NULL));
+  bench_parse_args(argc, argv);
+  rand_setup(bench_seed());
 
-  setup_screen();
+  setup_screen(SCREEN_SHADOW);
+  pool_start();
   setup_heights();
+  setup_erosion();
 
   fresh_map();
 
@@ -421,35 +901,44 @@ int main(int argc, char *argv[]) {
   	*height_at(x, y) = (y > terrain_length / 2) ? 0.3 : 0.8;
       }
     }
+    start_budget();
     deluge();
   }
+  if (bench.on) bench_erosion();
 
   gettimeofday(&t_start, NULL);
+  pacer_start(&pacer, bench_fps(TARGET_FPS));
+  bench_start();
 
   frame_counter = 0;
-  while (!Button()) {
+  while (bench_running(frame_counter) && !input_button()) {
     do_frame();
-    memcpy(screen.base, screen.shadow, screen.stride * screen.height * sizeof(uint32_t));
+    bench_begin(PHASE_PRESENT);
+    screen_present();
+    bench_end(PHASE_PRESENT);
+    bench_frame_done(frame_counter);
     frame_counter++;
 
-    {
-      struct timeval t_now;
-      gettimeofday(&t_now, NULL);
-      useconds_t d = (t_now.tv_sec - t_start.tv_sec) * 1000000 + (t_now.tv_usec - t_start.tv_usec);
-      long nap = frame_counter * (1000000 / 75) - d;
-      if (nap > 0) {
-	//usleep(nap);
-      }
-    }
+    pacer_wait(&pacer);
   }
 
   gettimeofday(&t_stop, NULL);
 
   {
     long delta = (t_stop.tv_sec - t_start.tv_sec) * 1000000 + (t_stop.tv_usec - t_start.tv_usec);
-    printf("%d frames took %lu microseconds, so %g frames/sec\n",
+    fprintf(bench.log, "%d frames took %lu microseconds, so %g frames/sec\n",
 	   frame_counter,
 	   delta,
 	   frame_counter / (delta / 1000000.0));
+    pacer_report(&pacer, bench.log);
+    bench_report(&pacer);
+    if (bench.on && erosion) {
+      fprintf(bench.log, "ground and water conserved to %.2g (tolerance %g)\n", budget.worst, MASS_TOLERANCE);
+      if (budget.worst > MASS_TOLERANCE) {
+	fprintf(bench.log, "erosion is not conserving mass\n");
+	return 1;
+      }
+    }
   }
+  return 0;
 }
@@ -0,0 +1,83 @@
+/* gcc -O3 -o fbheighttest fbheighttest.c -lm -lpthread
+ *
+ * Erodes fbheight's terrain with each erosion kernel the CPU can run,
+ * on one thread and on TEST_THREADS, with a shower every so often.
+ * Checks after every step that the ground and water on the map, plus
+ * what has run off the edges, less the rain, stay what they were to
+ * within MASS_TOLERANCE; and at the end that the terrain is the same,
+ * to the bit, as the scalar kernel's on one thread. Exits nonzero if
+ * either doesn't hold.
+ */
+#define main fbheight_main
+#include "fbheight.c"
+#undef main
+
+#define TEST_STEPS 500
+#define TEST_SHOWER_EVERY 100
+#define TEST_THREADS "7" /* more than 1, and not a divisor of the terrain */
+
+int main(void) {
+  size_t row_size, terrain_size;
+  cell *expected;
+  int failed = 0;
+  int threads[2];
+  int k, t, i, y;
+
+  /* however many CPUs there are */
+  setenv("FB_THREADS", TEST_THREADS, 1);
+  rand_setup(1);
+  pool_start();
+  setup_heights();
+  setup_erosion();
+  threads[0] = 1;
+  threads[1] = pool.n;
+
+  row_size = terrain_length * sizeof(cell);
+  terrain_size = terrain_length * row_size;
+  expected = malloc(terrain_size);
+  if (!expected) {
+    perror("malloc");
+    return 1;
+  }
+
+  for (k = 0; k < N_EROSION_KERNELS; k++) {
+    if (!erosion_kernels[k].ok) continue;
+    erosion_kernel = &erosion_kernels[k];
+
+    for (t = 0; t < 2; t++) {
+      int conserved, same = 1;
+
+      /* pool_run() does the job itself, leaving the workers idle */
+      pool.n = threads[t];
+      showers = 0;
+      fresh_map();
+      deluge();
+      budget.worst = 0;
+      for (i = 0; i < TEST_STEPS; i++) {
+	if (i % TEST_SHOWER_EVERY == TEST_SHOWER_EVERY - 1) rain = 1;
+	erode();
+	check_budget();
+      }
+      conserved = budget.worst <= MASS_TOLERANCE;
+
+      for (y = 0; y < terrain_length; y++) {
+	cell *row = &expected[y * terrain_length];
+	if (k == 0 && t == 0) {
+	  memcpy(row, cell_at1(terrain, 0, y), row_size);
+	} else if (memcmp(row, cell_at1(terrain, 0, y), row_size)) {
+	  same = 0;
+	}
+      }
+
+      printf("erosion %s, %d thread%s: conserved to %.2g over %d steps (tolerance %g)%s: %s\n",
+	     erosion_kernel->name, threads[t], threads[t] == 1 ? "" : "s",
+	     budget.worst, TEST_STEPS, MASS_TOLERANCE,
+	     same ? "" : ", but not the same as scalar on 1 thread",
+	     conserved && same ? "ok" : "FAILED");
+      if (!conserved || !same) failed = 1;
+    }
+  }
+  pool.n = threads[1];
+  free(expected);
+  return failed;
+}
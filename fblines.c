@@ -1,18 +1,15 @@
 /* gcc -arch i386 -O3 -o fblines fblines.c -framework ApplicationServices -framework Carbon
+ * gcc -O3 -o fblines fblines.c    (elsewhere; see fbscreen.h)
  */
 #include <stdint.h>
 #include <stdlib.h>
 #include <sys/time.h>
 #include <unistd.h>
 
-#include <ApplicationServices/ApplicationServices.h>
-
-static struct screen {
-  uint32_t *base;
-  int width;
-  int height;
-  int stride;
-} screen;
+#include "fbscreen.h"
+#include "fbpace.h"
+#include "fbbench.h"
+#include "fbrand.h"
 
 typedef struct keydef {
     int index;
@@ -43,19 +40,11 @@ static int alive_count;
 
 static int frame_counter = 0;
 
-static void setup_screen(void) {
-  CGDirectDisplayID targetDisplay = kCGDirectMainDisplay;
-
-  CGDisplayCapture(targetDisplay); /* crucial for being permitted to write on it */
-  screen.base = (uint32_t *) CGDisplayBaseAddress(targetDisplay);
-  screen.stride = CGDisplayBytesPerRow(targetDisplay) / sizeof(uint32_t);
-  screen.width = CGDisplayPixelsWide(targetDisplay);
-  screen.height = CGDisplayPixelsHigh(targetDisplay);
-}
-
 static void init_player(player_t *p, int color) {
-  p->x = random() % screen.width;
-  p->y = random() % screen.height;
+  struct rng r = rand_stream(RAND_PLAYERS);
+  rand_seek(&r, (uint64_t) (p - players) * 2);
+  p->x = rand_below(&r, screen.width);
+  p->y = rand_below(&r, screen.height);
   p->direction = 0;
   p->is_dead = 0;
   p->color = color;
@@ -84,25 +73,11 @@ static void setup_players(void) {
   players[1].keydefs[3] = KEYDEF(0, 0x00000040) /* z */;
 }
 
-static void clrscr(void) {
-  memset(screen.base,
-	 0,
-	 ((screen.height-1) * screen.stride + screen.width) * sizeof(uint32_t));
-}
-
-static void putpixel(int x, int y, int c) {
-  screen.base[y * screen.stride + x] = c;
-}
-
-static int getpixel(int x, int y) {
-  return screen.base[y * screen.stride + x];
-}
-
 static void do_frame() {
   uint32_t keys[4];
   int i, d;
 
-  GetKeys(&keys[0]);
+  input_keys(&keys[0]);
 
   for (i = 0; i < n_players; i++) {
     player_t *p = &players[i];
@@ -141,7 +116,7 @@ static void do_frame() {
 
     if (getpixel(p->x, p->y) != 0) {
       /* crash! */
-      printf("Crash for player %d at %d, %d\n", i, p->x, p->y);
+      fprintf(bench.log, "Crash for player %d at %d, %d\n", i, p->x, p->y);
       p->is_dead = 1;
       continue;
     }
@@ -154,42 +129,43 @@ static void do_frame() {
 
 int main(int argc, char *argv[]) {
   struct timeval t_start, t_stop;
+  struct pacer pacer;
 
-  srandom(time(NULL));
+  bench_parse_args(argc, argv);
+  rand_setup(bench_seed());
 
-  setup_screen();
+  setup_screen(SCREEN_DIRECT);
   setup_players();
 
   gettimeofday(&t_start, NULL);
+  pacer_start(&pacer, bench_fps(TARGET_FPS));
+  bench_start();
 
   clrscr();
 
   frame_counter = 0;
   alive_count = n_players;
 
-  while ((alive_count > 1) && !Button()) {
+  while ((alive_count > 1) && bench_running(frame_counter) && !input_button()) {
+    bench_begin(PHASE_DRAW);
     do_frame();
+    bench_end(PHASE_DRAW);
+    bench_frame_done(frame_counter);
     frame_counter++;
 
-    {
-      struct timeval t_now;
-      gettimeofday(&t_now, NULL);
-      useconds_t d = (t_now.tv_sec - t_start.tv_sec) * 1000000 + (t_now.tv_usec - t_start.tv_usec);
-      long nap = frame_counter * (1000000.0 / TARGET_FPS) - d;
-      if (nap > 0) {
-	usleep(nap);
-      }
-    }
+    pacer_wait(&pacer);
   }
 
   gettimeofday(&t_stop, NULL);
 
   {
     long delta = (t_stop.tv_sec - t_start.tv_sec) * 1000000 + (t_stop.tv_usec - t_start.tv_usec);
-    printf("%d frames took %lu microseconds, so %g frames/sec\n",
+    fprintf(bench.log, "%d frames took %lu microseconds, so %g frames/sec\n",
 	   frame_counter,
 	   delta,
 	   frame_counter / (delta / 1000000.0));
+    pacer_report(&pacer, bench.log);
+    bench_report(&pacer);
   }
 
   {
@@ -197,9 +173,9 @@ int main(int argc, char *argv[]) {
     for (i = 0; i < n_players; i++) {
       player_t *p = &players[i];
       if (p->is_dead) {
-	printf("player %d DIED\n", i);
+	fprintf(bench.log, "player %d DIED\n", i);
       } else {
-	printf("PLAYER %d SURVIVED!!!\n", i);
+	fprintf(bench.log, "PLAYER %d SURVIVED!!!\n", i);
       }
     }
   }
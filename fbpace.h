@@ -0,0 +1,138 @@
+/* Frame pacing against absolute deadlines on the monotonic clock.
+ *
+ * pacer_wait() sleeps until frame N's deadline, start + N * period,
+ * so oversleeping one frame doesn't push back all the ones after it,
+ * and changes to the wall clock don't matter. With FB_VSYNC=1 it
+ * waits for the vertical blank instead, where the target supports it.
+ * A period of zero means run flat out; the statistics are still kept.
+ *
+ * Frame times (wakeup to wakeup) go into a log-linear histogram with
+ * 32 buckets per power of two, good to about 3%.
+ */
+#ifndef FBPACE_H
+#define FBPACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "fbscreen.h"
+
+#define PACER_SUB_BITS 5
+#define PACER_BUCKETS ((65 - PACER_SUB_BITS) << PACER_SUB_BITS)
+
+struct pacer {
+  long period;      /* nanoseconds; 0 for unpaced */
+  int vsync;
+  struct timespec deadline;
+  struct timespec last;
+  long frames;
+  long missed;
+  uint64_t max;     /* microseconds */
+  uint32_t histogram[PACER_BUCKETS];
+};
+
+static int64_t ts_nsec(struct timespec t) {
+  return (int64_t) t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+static struct timespec nsec_ts(int64_t n) {
+  struct timespec t;
+  t.tv_sec = n / 1000000000;
+  t.tv_nsec = n % 1000000000;
+  return t;
+}
+
+static int pacer_bucket(uint64_t us) {
+  int e;
+  if (us < (1 << PACER_SUB_BITS)) return us;
+  e = 63 - __builtin_clzll(us);
+  return ((e - PACER_SUB_BITS + 1) << PACER_SUB_BITS)
+    + ((us >> (e - PACER_SUB_BITS)) & ((1 << PACER_SUB_BITS) - 1));
+}
+
+/* The smallest value that lands in bucket b. */
+static uint64_t pacer_bucket_floor(int b) {
+  int e = (b >> PACER_SUB_BITS) + PACER_SUB_BITS - 1;
+  if (b < (1 << PACER_SUB_BITS)) return b;
+  return ((uint64_t) ((1 << PACER_SUB_BITS) | (b & ((1 << PACER_SUB_BITS) - 1)))) << (e - PACER_SUB_BITS);
+}
+
+static void pacer_start(struct pacer *p, int fps) {
+  memset(p, 0, sizeof(*p));
+  p->period = fps > 0 ? 1000000000L / fps : 0;
+  p->vsync = getenv("FB_VSYNC") && atoi(getenv("FB_VSYNC"));
+  clock_gettime(CLOCK_MONOTONIC, &p->last);
+  p->deadline = p->last;
+}
+
+static void pacer_sleep_until(struct timespec t) {
+#ifdef __APPLE__
+  struct timespec now;
+  int64_t d;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  d = ts_nsec(t) - ts_nsec(now);
+  if (d > 0) {
+    struct timespec nap = nsec_ts(d);
+    nanosleep(&nap, NULL);
+  }
+#else
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL) == EINTR)
+    ;
+#endif
+}
+
+/* Called once per frame, after presenting it. */
+static void pacer_wait(struct pacer *p) {
+  struct timespec now;
+  int64_t deadline = ts_nsec(p->deadline) + p->period;
+  uint64_t us;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (p->period) {
+    if (ts_nsec(now) > deadline) {
+      p->missed++;
+      /* Don't rush through frames trying to catch up. */
+      if (ts_nsec(now) > deadline + p->period) deadline = ts_nsec(now);
+    }
+    p->deadline = nsec_ts(deadline);
+    if (!p->vsync || screen_wait_vsync() < 0) {
+      pacer_sleep_until(p->deadline);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+  }
+
+  us = (ts_nsec(now) - ts_nsec(p->last)) / 1000;
+  p->last = now;
+  p->frames++;
+  p->histogram[pacer_bucket(us)]++;
+  if (us > p->max) p->max = us;
+}
+
+static uint64_t pacer_percentile(struct pacer *p, double pct) {
+  uint64_t want = p->frames * pct / 100;
+  uint64_t seen = 0;
+  int b;
+  for (b = 0; b < PACER_BUCKETS; b++) {
+    seen += p->histogram[b];
+    if (seen > want) {
+      /* The middle of the bucket, but never more than the maximum. */
+      uint64_t mid = (pacer_bucket_floor(b) + pacer_bucket_floor(b + 1)) / 2;
+      return mid < p->max ? mid : p->max;
+    }
+  }
+  return p->max;
+}
+
+static void pacer_report(struct pacer *p, FILE *f) {
+  if (p->frames == 0) return;
+  fprintf(f, "frame times: p50 %lu, p95 %lu, p99 %lu, max %lu microseconds; %ld of %ld deadlines missed\n",
+	  (unsigned long) pacer_percentile(p, 50),
+	  (unsigned long) pacer_percentile(p, 95),
+	  (unsigned long) pacer_percentile(p, 99),
+	  (unsigned long) p->max,
+	  p->missed,
+	  p->frames);
+}
+
+#endif
@@ -0,0 +1,102 @@
+/* A fixed pool of worker threads.
+ *
+ *   pool_start();
+ *   pool_run(job);     calls job(i, pool.n) for i = 0 .. pool.n - 1,
+ *                      one call per thread, and waits for all of them
+ *
+ * The calling thread does share 0 itself. The number of threads comes
+ * from FB_THREADS (or --threads N, see fbbench.h), and defaults to the
+ * number of CPUs online. Jobs that want results independent of the
+ * thread count should split their work on fixed boundaries and merge
+ * it in a fixed order; pool_run() itself promises nothing about which
+ * share finishes first.
+ */
+#ifndef FBPOOL_H
+#define FBPOOL_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define POOL_MAX_THREADS 256
+
+static struct pool {
+  int n;
+  pthread_t threads[POOL_MAX_THREADS];
+  pthread_mutex_t lock;
+  pthread_cond_t go;
+  pthread_cond_t done;
+  void (*job)(int i, int n);
+  unsigned generation;
+  int pending;
+} pool;
+
+static void *pool_worker(void *arg) {
+  int i = (int) (intptr_t) arg;
+  unsigned seen = 0;
+
+  for (;;) {
+    void (*job)(int, int);
+    pthread_mutex_lock(&pool.lock);
+    while (pool.generation == seen) {
+      pthread_cond_wait(&pool.go, &pool.lock);
+    }
+    seen = pool.generation;
+    job = pool.job;
+    pthread_mutex_unlock(&pool.lock);
+
+    job(i, pool.n);
+
+    pthread_mutex_lock(&pool.lock);
+    if (--pool.pending == 0) {
+      pthread_cond_signal(&pool.done);
+    }
+    pthread_mutex_unlock(&pool.lock);
+  }
+  return NULL;
+}
+
+static void pool_start(void) {
+  const char *s = getenv("FB_THREADS");
+  int i;
+
+  pool.n = s ? atoi(s) : (int) sysconf(_SC_NPROCESSORS_ONLN);
+  if (pool.n < 1) pool.n = 1;
+  if (pool.n > POOL_MAX_THREADS) pool.n = POOL_MAX_THREADS;
+
+  pthread_mutex_init(&pool.lock, NULL);
+  pthread_cond_init(&pool.go, NULL);
+  pthread_cond_init(&pool.done, NULL);
+  for (i = 1; i < pool.n; i++) {
+    if (pthread_create(&pool.threads[i], NULL, pool_worker, (void *) (intptr_t) i)) {
+      perror("pthread_create");
+      exit(1);
+    }
+  }
+}
+
+static void pool_run(void (*job)(int i, int n)) {
+  if (pool.n == 1) {
+    job(0, 1);
+    return;
+  }
+
+  pthread_mutex_lock(&pool.lock);
+  pool.job = job;
+  pool.pending = pool.n - 1;
+  pool.generation++;
+  pthread_cond_broadcast(&pool.go);
+  pthread_mutex_unlock(&pool.lock);
+
+  job(0, pool.n);
+
+  pthread_mutex_lock(&pool.lock);
+  while (pool.pending) {
+    pthread_cond_wait(&pool.done, &pool.lock);
+  }
+  pthread_mutex_unlock(&pool.lock);
+}
+
+#endif
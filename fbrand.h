@@ -0,0 +1,68 @@
+/* Counter-based random numbers.
+ *
+ *   rand_setup(bench_seed());
+ *   struct rng r = rand_stream(RAND_RAIN + n);
+ *   x = rand_below(&r, width);
+ *
+ * The k'th number of a stream is a hash of the seed, the stream number
+ * and k (splitmix64's finaliser, which passes BigCrush), so there is
+ * no shared state and no lock: any thread can make any stream, or jump
+ * to any point in one with rand_seek(). Work that gives each item its
+ * own stream, or its own place in a stream, comes out the same however
+ * it is split between threads, and in whatever order.
+ *
+ * Demos number their streams from the RAND_ constants below, so that
+ * different uses of the same seed don't see the same numbers.
+ */
+#ifndef FBRAND_H
+#define FBRAND_H
+
+#include <stdint.h>
+
+#define RAND_PARTICLES 0x100000000ULL   /* + generation */
+#define RAND_TERRAIN   0x200000000ULL
+#define RAND_RAIN      0x300000000ULL   /* + shower */
+#define RAND_PLAYERS   0x400000000ULL
+#define RAND_FIELD     0x500000000ULL
+
+#define RAND_GOLDEN 0x9e3779b97f4a7c15ULL
+
+struct rng {
+  uint64_t key;
+  uint64_t n;
+};
+
+static uint64_t rand_seed;
+
+static void rand_setup(uint64_t seed) {
+  rand_seed = seed;
+}
+
+static uint64_t rand_mix(uint64_t z) {
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+static struct rng rand_stream(uint64_t stream) {
+  struct rng r;
+  r.key = rand_mix(rand_seed ^ rand_mix(stream * RAND_GOLDEN));
+  r.n = 0;
+  return r;
+}
+
+/* The next call gives number n of the stream. */
+static void rand_seek(struct rng *r, uint64_t n) {
+  r->n = n;
+}
+
+static uint32_t rand_next(struct rng *r) {
+  return rand_mix(r->key + r->n++ * RAND_GOLDEN) >> 32;
+}
+
+/* 0 <= result < n, by multiplying rather than taking a remainder. */
+static uint32_t rand_below(struct rng *r, uint32_t n) {
+  return ((uint64_t) rand_next(r) * n) >> 32;
+}
+
+#endif
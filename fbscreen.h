@@ -0,0 +1,396 @@
+/* Framebuffer backend shared by the demos.
+ *
+ * Which framebuffer we draw on is chosen by the FB_TARGET environment
+ * variable:
+ *
+ *   FB_TARGET=/dev/fb0                  a Linux framebuffer device (default on Linux)
+ *   FB_TARGET=cg                        the main display, via CGDisplayCapture (default on OS X)
+ *   FB_TARGET=anon:1920x1080            anonymous memory that nobody looks at
+ *   FB_TARGET=memfd:3840x2160/4096      a memfd; the optional /N is the stride in pixels
+ *   FB_TARGET=file:7680x4320:/tmp/fb    a shared mapping of a file, for looking at afterwards
+ *
+ * The fake targets make it possible to run (and time) the demos at any
+ * resolution on a machine with no display at all.
+ *
+ * With FB_FLIP=1 a framebuffer device is asked for a virtual
+ * resolution twice the height of the real one; frames are then drawn
+ * into the hidden half and shown with FBIOPAN_DISPLAY. If the driver
+ * says no, we quietly go back to drawing on (or copying to) the
+ * visible screen.
+ */
+#ifndef FBSCREEN_H
+#define FBSCREEN_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#ifdef __APPLE__
+#include <ApplicationServices/ApplicationServices.h>
+#else
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/fb.h>
+
+typedef struct Point {
+  int h;
+  int v;
+} Point;
+#endif
+
+#define SCREEN_DIRECT 0 /* draw straight onto the visible framebuffer */
+#define SCREEN_SHADOW 1 /* draw into a malloc'd shadow, copied out by screen_present() */
+#define SCREEN_REDRAW 2 /* every pixel is redrawn each frame, so may draw into a back page */
+
+#ifndef MAX
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define MIN(a, b) ((a) > (b) ? (b) : (a))
+#endif
+
+#define TARGET_FBDEV 0
+#define TARGET_CG 1
+#define TARGET_ANON 2
+#define TARGET_MEMFD 3
+#define TARGET_FILE 4
+
+static struct screen {
+  uint32_t *base;
+  uint32_t *shadow;
+  int width;
+  int height;
+  int stride;
+  int kind;
+  int mode;
+  int fd;
+  size_t map_len;
+  int flip;         /* nonzero when page flipping */
+  uint32_t *pages[2];
+  int back;         /* index of the page not being scanned out */
+#ifndef __APPLE__
+  struct fb_var_screeninfo var;
+#endif
+  /* Per-row spans [lo, hi] of pixels written since the last present
+     (dirty) and since the last clrscr (used); lo > hi means none. */
+  int *dirty_lo, *dirty_hi;
+  int *used_lo, *used_hi;
+  int *prev_lo, *prev_hi; /* dirty spans of the previous frame, when flipping */
+} screen;
+
+static void screen_die(const char *what) {
+  perror(what);
+  if (screen.fd >= 0) close(screen.fd);
+  exit(1);
+}
+
+#ifdef __APPLE__
+static void setup_cg(void) {
+  CGDirectDisplayID targetDisplay = kCGDirectMainDisplay;
+
+  CGDisplayCapture(targetDisplay); /* crucial for being permitted to write on it */
+  screen.base = (uint32_t *) CGDisplayBaseAddress(targetDisplay);
+  screen.stride = CGDisplayBytesPerRow(targetDisplay) / sizeof(uint32_t);
+  screen.width = CGDisplayPixelsWide(targetDisplay);
+  screen.height = CGDisplayPixelsHigh(targetDisplay);
+}
+#else
+static void setup_fbdev(const char *path) {
+  struct fb_fix_screeninfo f;
+  struct fb_var_screeninfo v;
+
+  screen.fd = open(path, O_RDWR);
+  if (screen.fd < 0) screen_die(path);
+  if (ioctl(screen.fd, FBIOGET_FSCREENINFO, &f) < 0) screen_die("ioctl FBIOGET_FSCREENINFO");
+  if (ioctl(screen.fd, FBIOGET_VSCREENINFO, &v) < 0) screen_die("ioctl FBIOGET_VSCREENINFO");
+  screen.map_len = f.smem_len;
+  screen.base = mmap(NULL, screen.map_len, PROT_READ | PROT_WRITE, MAP_SHARED, screen.fd, 0);
+  if (screen.base == MAP_FAILED) screen_die("mmap");
+  screen.stride = f.line_length / sizeof(uint32_t);
+  screen.width = v.xres;
+  screen.height = v.yres;
+  screen.var = v;
+}
+
+/* Asks for a second page below the visible one. */
+static int setup_flip(void) {
+  struct fb_var_screeninfo v = screen.var;
+  size_t page_len = (size_t) screen.stride * screen.height * sizeof(uint32_t);
+
+  v.yres_virtual = 2 * v.yres;
+  v.yoffset = 0;
+  if (ioctl(screen.fd, FBIOPUT_VSCREENINFO, &v) < 0 ||
+      ioctl(screen.fd, FBIOGET_VSCREENINFO, &v) < 0 ||
+      v.yres_virtual < 2 * v.yres ||
+      screen.map_len < 2 * page_len) {
+    fprintf(stderr, "Page flipping not available; copying to the visible screen instead\n");
+    return 0;
+  }
+  screen.var = v;
+  screen.pages[0] = screen.base;
+  screen.pages[1] = screen.base + screen.stride * screen.height;
+  screen.back = 1;
+  return 1;
+}
+
+static void screen_flip(void) {
+  screen.var.yoffset = screen.back * screen.height;
+  if (ioctl(screen.fd, FBIOPAN_DISPLAY, &screen.var) < 0) {
+    perror("ioctl FBIOPAN_DISPLAY");
+  }
+  screen.base = screen.pages[screen.back];
+  screen.back = !screen.back;
+}
+#endif
+
+/* anon:WxH[/STRIDE], memfd:WxH[/STRIDE] or file:WxH[/STRIDE]:PATH */
+static void setup_fake(const char *spec) {
+  const char *geometry = strchr(spec, ':');
+  const char *path = NULL;
+  int n = 0;
+
+  if (!geometry) {
+    fprintf(stderr, "Bad FB_TARGET: %s\n", spec);
+    exit(1);
+  }
+  geometry++;
+
+  screen.stride = 0;
+  if (sscanf(geometry, "%dx%d%n/%d%n", &screen.width, &screen.height, &n, &screen.stride, &n) < 2
+      || screen.width <= 0 || screen.height <= 0) {
+    fprintf(stderr, "Bad FB_TARGET geometry: %s\n", spec);
+    exit(1);
+  }
+  if (screen.stride < screen.width) screen.stride = screen.width;
+  screen.map_len = (size_t) screen.stride * screen.height * sizeof(uint32_t);
+
+  if (!strncmp(spec, "anon:", 5)) {
+    screen.kind = TARGET_ANON;
+    screen.base = mmap(NULL, screen.map_len, PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  } else {
+    if (!strncmp(spec, "memfd:", 6)) {
+      screen.kind = TARGET_MEMFD;
+#ifdef SYS_memfd_create
+      screen.fd = syscall(SYS_memfd_create, "fbscreen", 0);
+#else
+      errno = ENOSYS;
+#endif
+      if (screen.fd < 0) screen_die("memfd_create");
+    } else if (!strncmp(spec, "file:", 5) && geometry[n] == ':') {
+      screen.kind = TARGET_FILE;
+      path = geometry + n + 1;
+      screen.fd = open(path, O_RDWR | O_CREAT, 0644);
+      if (screen.fd < 0) screen_die(path);
+    } else {
+      fprintf(stderr, "Bad FB_TARGET: %s\n", spec);
+      exit(1);
+    }
+    if (ftruncate(screen.fd, screen.map_len) < 0) screen_die("ftruncate");
+    screen.base = mmap(NULL, screen.map_len, PROT_READ | PROT_WRITE, MAP_SHARED, screen.fd, 0);
+  }
+  if (screen.base == MAP_FAILED) screen_die("mmap");
+}
+
+static void setup_screen(int mode) {
+  const char *target = getenv("FB_TARGET");
+
+  screen.fd = -1;
+  if (target == NULL || !*target) {
+#ifdef __APPLE__
+    target = "cg";
+#else
+    target = "/dev/fb0";
+#endif
+  }
+
+  if (!strcmp(target, "cg")) {
+#ifdef __APPLE__
+    screen.kind = TARGET_CG;
+    setup_cg();
+#else
+    fprintf(stderr, "FB_TARGET=cg is only available on OS X\n");
+    exit(1);
+#endif
+  } else if (target[0] == '/') {
+#ifdef __APPLE__
+    fprintf(stderr, "FB_TARGET=%s: framebuffer devices are only available on Linux\n", target);
+    exit(1);
+#else
+    screen.kind = TARGET_FBDEV;
+    setup_fbdev(target);
+    if (mode != SCREEN_DIRECT && getenv("FB_FLIP") && atoi(getenv("FB_FLIP"))) {
+      screen.flip = setup_flip();
+    }
+#endif
+  } else {
+    setup_fake(target);
+  }
+
+  screen.mode = mode;
+  if (mode == SCREEN_SHADOW) {
+    screen.shadow = malloc(screen.stride * screen.height * sizeof(uint32_t));
+  } else if (screen.flip) {
+    screen.shadow = screen.pages[screen.back];
+  } else {
+    screen.shadow = screen.base;
+  }
+
+  {
+    int y;
+    screen.dirty_lo = malloc(6 * screen.height * sizeof(int));
+    screen.dirty_hi = screen.dirty_lo + screen.height;
+    screen.used_lo = screen.dirty_hi + screen.height;
+    screen.used_hi = screen.used_lo + screen.height;
+    screen.prev_lo = screen.used_hi + screen.height;
+    screen.prev_hi = screen.prev_lo + screen.height;
+    /* Nothing is known about the initial contents. */
+    for (y = 0; y < screen.height; y++) {
+      screen.dirty_lo[y] = screen.used_lo[y] = screen.prev_lo[y] = 0;
+      screen.dirty_hi[y] = screen.used_hi[y] = screen.prev_hi[y] = screen.width - 1;
+    }
+  }
+}
+
+static void damage(int x0, int x1, int y) {
+  if (x0 < screen.dirty_lo[y]) screen.dirty_lo[y] = x0;
+  if (x1 > screen.dirty_hi[y]) screen.dirty_hi[y] = x1;
+  if (x0 < screen.used_lo[y]) screen.used_lo[y] = x0;
+  if (x1 > screen.used_hi[y]) screen.used_hi[y] = x1;
+}
+
+/* Returns 0 once the vertical blank has started, or -1 when the
+   target can't tell us. */
+static int screen_wait_vsync(void) {
+#ifndef __APPLE__
+  uint32_t crtc = 0;
+  if (screen.kind == TARGET_FBDEV) {
+    return ioctl(screen.fd, FBIO_WAITFORVSYNC, &crtc);
+  }
+#endif
+  return -1;
+}
+
+static void screen_copy(uint32_t *dst, uint32_t *src, size_t n) {
+  memcpy(dst, src, n * sizeof(uint32_t));
+}
+
+/* Copies the parts of the frame that changed to the framebuffer,
+   passing each span through copy() on the way. */
+static void screen_present_with(void (*copy)(uint32_t *dst, uint32_t *src, size_t n)) {
+  int y;
+
+#ifndef __APPLE__
+  if (screen.flip) {
+    if (screen.mode == SCREEN_SHADOW) {
+      /* The back page last saw the frame before the previous one, so
+	 it needs what changed in both. */
+      uint32_t *page = screen.pages[screen.back];
+      for (y = 0; y < screen.height; y++) {
+	int lo = MIN(screen.dirty_lo[y], screen.prev_lo[y]);
+	int hi = MAX(screen.dirty_hi[y], screen.prev_hi[y]);
+	if (lo <= hi) {
+	  size_t offset = y * screen.stride + lo;
+	  copy(page + offset, screen.shadow + offset, hi - lo + 1);
+	}
+	screen.prev_lo[y] = screen.dirty_lo[y];
+	screen.prev_hi[y] = screen.dirty_hi[y];
+	screen.dirty_lo[y] = screen.width;
+	screen.dirty_hi[y] = -1;
+      }
+      screen_flip();
+    } else {
+      screen_flip();
+      screen.shadow = screen.pages[screen.back];
+    }
+    return;
+  }
+#endif
+
+  for (y = 0; y < screen.height; y++) {
+    int lo = screen.dirty_lo[y];
+    int hi = screen.dirty_hi[y];
+    if (lo <= hi) {
+      if (screen.shadow != screen.base) {
+	size_t offset = y * screen.stride + lo;
+	copy(screen.base + offset, screen.shadow + offset, hi - lo + 1);
+      }
+      screen.dirty_lo[y] = screen.width;
+      screen.dirty_hi[y] = -1;
+    }
+  }
+}
+
+static inline void screen_present(void) {
+  screen_present_with(screen_copy);
+}
+
+/* Only the pixels drawn since the last clrscr need clearing. */
+static inline void clrscr(void) {
+  int y;
+  for (y = 0; y < screen.height; y++) {
+    int lo = screen.used_lo[y];
+    int hi = screen.used_hi[y];
+    if (lo <= hi) {
+      memset(screen.shadow + y * screen.stride + lo, 0, (hi - lo + 1) * sizeof(uint32_t));
+      if (lo < screen.dirty_lo[y]) screen.dirty_lo[y] = lo;
+      if (hi > screen.dirty_hi[y]) screen.dirty_hi[y] = hi;
+      screen.used_lo[y] = screen.width;
+      screen.used_hi[y] = -1;
+    }
+  }
+}
+
+static inline void putpixel(int x, int y, int c) {
+  screen.shadow[y * screen.stride + x] = c;
+  damage(x, x, y);
+}
+
+static inline int getpixel(int x, int y) {
+  return screen.shadow[y * screen.stride + x];
+}
+
+/* Input only comes from a real display, and only when it isn't
+ * being ignored for a benchmark; otherwise the mouse is parked at
+ * (100, 100) and no keys or button are pressed.
+ */
+static int input_synthetic = 0;
+
+static inline void input_mouse(Point *loc) {
+#ifdef __APPLE__
+  if (screen.kind == TARGET_CG && !input_synthetic) {
+    GetMouse(loc);
+    return;
+  }
+#endif
+  loc->h = 100;
+  loc->v = 100;
+}
+
+static inline void input_keys(uint32_t *keys) {
+#ifdef __APPLE__
+  if (screen.kind == TARGET_CG && !input_synthetic) {
+    GetKeys((void *) keys);
+    return;
+  }
+#endif
+  memset(keys, 0, 4 * sizeof(uint32_t));
+}
+
+static inline int input_button(void) {
+#ifdef __APPLE__
+  if (screen.kind == TARGET_CG && !input_synthetic) {
+    return Button();
+  }
+#endif
+  return 0;
+}
+
+#endif
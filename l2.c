@@ -1,4 +1,4 @@
-/* gcc -arch i386 -O3 -o fb2 fb2.c -framework ApplicationServices -framework Carbon
+/* gcc -O3 -o l2 l2.c
  */
 #include <stdint.h>
 #include <stdlib.h>
@@ -8,71 +8,16 @@
 #include <math.h>
 #include <stdio.h>
 
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <fcntl.h>
-#include <sys/mman.h>
-#include <sys/ioctl.h>
+#include "fbscreen.h"
+#include "fbpace.h"
+#include "fbbench.h"
 
-#include <linux/fb.h>
+#define TARGET_FPS 0 /* as fast as possible */
 
 static char *fontdata[]; /* forward declaration */
 
-static struct {
-  uint32_t *base;
-  int width;
-  int height;
-  int stride;
-} screen;
-
-typedef struct Point {
-  int h;
-  int v;
-} Point;
-
 static int frame_counter = 0;
 
-static void setup_screen(void) {
-  struct fb_fix_screeninfo f;
-  struct fb_var_screeninfo v;
-  int fb = open("/dev/fb0", O_RDWR);
-  if (fb < 0) {
-    perror("open /dev/fb0");
-    exit(1);
-  }
-  if (ioctl(fb, FBIOGET_FSCREENINFO, &f) < 0) {
-    perror("ioctl FBIOGET_FSCREENINFO");
-    close(fb);
-    exit(1);
-  }
-  if (ioctl(fb, FBIOGET_VSCREENINFO, &v) < 0) {
-    perror("ioctl FBIOGET_VSCREENINFO");
-    close(fb);
-    exit(1);
-  }
-  screen.base = mmap(NULL, f.smem_len, PROT_READ | PROT_WRITE, MAP_SHARED, fb, 0);
-  if (screen.base == NULL) {
-    perror("mmap");
-    close(fb);
-    exit(1);
-  }
-  screen.stride = f.line_length / sizeof(uint32_t);
-  screen.width = v.xres;
-  screen.height = v.yres;
-}
-
-static void clrscr(void) {
-  memset(screen.base, 0, ((screen.height-1) * screen.stride + screen.width) * sizeof(uint32_t));
-}
-
-static void putpixel(int x, int y, int c) {
-  screen.base[y * screen.stride + x] = c;
-}
-
-static int getpixel(int x, int y) {
-  return screen.base[y * screen.stride + x];
-}
-
 static int glyph_pixel(char c, unsigned int x, unsigned int y) {
   int row = (c / 16) * 16 + (y % 16);
   int col = (c % 16) * 16 + (x % 8) + 5;
@@ -85,9 +30,7 @@ static void do_frame() {
   int messagelen = strlen(message);
   int x, y;
 
-  // GetMouse(&loc);
-  loc.h = 100;
-  loc.v = 100;
+  input_mouse(&loc);
 
   for (y = 0; y < screen.height; y++) {
     for (x = 0; x < screen.width; x++) {
@@ -109,9 +52,7 @@ static void do_frame0() {
   Point loc;
   int x, y, c;
 
-  // GetMouse(&loc);
-  loc.h = 100;
-  loc.v = 100;
+  input_mouse(&loc);
 
   c = 0;
   /* memset(screen, c, ((height-1) * stride + width) * sizeof(pix_t)); */
@@ -131,25 +72,38 @@ static void do_frame0() {
 
 int main(int argc, char *argv[]) {
   struct timeval t_start, t_stop;
+  struct pacer pacer;
 
-  setup_screen();
+  bench_parse_args(argc, argv);
+  setup_screen(SCREEN_REDRAW);
 
   gettimeofday(&t_start, NULL);
+  pacer_start(&pacer, bench_fps(TARGET_FPS));
+  bench_start();
 
   frame_counter = 0;
-  while (1) {
+  while (bench_running(frame_counter)) {
+    bench_begin(PHASE_DRAW);
     do_frame();
+    bench_end(PHASE_DRAW);
+    bench_begin(PHASE_PRESENT);
+    screen_present();
+    bench_end(PHASE_PRESENT);
+    bench_frame_done(frame_counter);
     frame_counter++;
+    pacer_wait(&pacer);
   }
 
   gettimeofday(&t_stop, NULL);
 
   {
     long delta = (t_stop.tv_sec - t_start.tv_sec) * 1000000 + (t_stop.tv_usec - t_start.tv_usec);
-    printf("%d frames took %lu microseconds, so %g frames/sec\n",
+    fprintf(bench.log, "%d frames took %lu microseconds, so %g frames/sec\n",
 	   frame_counter,
 	   delta,
 	   frame_counter / (delta / 1000000.0));
+    pacer_report(&pacer, bench.log);
+    bench_report(&pacer);
   }
 }
 
@@ -1,4 +1,4 @@
-/* gcc -O3 -o fbflow fbflow.c
+/* gcc -O3 -o lflow lflow.c -lm -lpthread
  */
 #include <stdint.h>
 #include <stdlib.h>
@@ -8,34 +8,31 @@
 #include <math.h>
 #include <stdio.h>
 
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <fcntl.h>
-#include <sys/mman.h>
-#include <sys/ioctl.h>
+#include "fbscreen.h"
+#include "fbpace.h"
+#include "fbbench.h"
+#include "fbfade.h"
+#include "fbpool.h"
+#include "fbrand.h"
+#include "fbarena.h"
 
-#include <linux/fb.h>
+#define TARGET_FPS 75
 
-static struct screen {
-  uint32_t *base;
-  uint32_t *shadow;
-  int width;
-  int height;
-  int stride;
-} screen;
-
-typedef struct Point {
-  int h;
-  int v;
-} Point;
-
-#define N_PARTICLES 50000
+#define N_PARTICLES 50000   /* the default; LFLOW_PARTICLES=n picks another */
 #define ERASE_TRACKS 0
 #define WANT_FADE 1
+#define WANT_LAZY_FADE 0 /* fade while presenting, instead of in a pass of its own */
+#define WANT_FUSED_FADE 1 /* or fade for the next frame while presenting this one */
 #define WANT_REPLACEMENTS 0
+#define WANT_NBODY 0     /* particles attract each other as well as the masses */
+#define WANT_FIELD 0     /* and N_ATTRACTORS fixed attractors, through a grid */
+#define WANT_DENSITY 0   /* show how many particles pass each pixel, instead of fading */
+#define WANT_INDEXED 0   /* draw 16-bit palette indices, not XRGB; see setup_indexed() */
 
 #define FADE_FACTOR 0.999
 
+#define FUSED_FADE (WANT_FADE && (WANT_FUSED_FADE || WANT_INDEXED) && !WANT_LAZY_FADE && !WANT_DENSITY)
+
 #define N_MASSES 2
 
 #define MAX_COLOR 1024
@@ -46,9 +43,30 @@ typedef struct Point {
 #define M1 1000
 #define M2 10000
 
-static struct particle {
-  float x, y, vx, vy;
-} particles[N_PARTICLES];
+/* Particles are kept as a structure of arrays, padded out to a whole
+   number of the widest vectors with dead particles, so the kernels
+   below can take them 8 or 16 at a time. After integrate() has run,
+   pix holds the packed (y << 16) | x of each particle that should be
+   drawn, or -1, and col its index into colors[].
+
+   Without replacements particles only ever die, so every so often
+   the live ones are moved down to the front, keeping their order, and
+   the kernels only look at the first n slots. */
+#define PARTICLE_LANES 16
+
+static int n_particles;
+static int n_slots;
+
+static struct particles {
+  int n;         /* slots in use, a multiple of PARTICLE_LANES */
+  int live;      /* particles still alive; the rest of the n are dead */
+  float *x, *y, *vx, *vy;
+  int32_t *pix;
+  int32_t *col;
+#if ERASE_TRACKS
+  int32_t *old;  /* where each particle was, for erasing, or -1 */
+#endif
+} particles;
 
 static struct mass {
   float x, y;
@@ -61,52 +79,1521 @@ static uint32_t colors[MAX_COLOR];
 
 static int frame_counter = 0;
 
-static void setup_screen(void) {
-  struct fb_fix_screeninfo f;
-  struct fb_var_screeninfo v;
-  int fb = open("/dev/fb0", O_RDWR);
-  if (fb < 0) {
-    perror("open /dev/fb0");
+#if WANT_FADE && WANT_LAZY_FADE
+static int *row_drawn; /* the frame each row was last drawn on */
+#endif
+#if WANT_FADE && !WANT_DENSITY
+static int fused_fade;  /* nonzero when presenting fades for the next frame; see present_and_fade() */
+#endif
+
+/* Thread i of n's share of the particles, in whole vectors. */
+static void slice_of(int i, int n, int *lo, int *hi) {
+  int per = (particles.n / PARTICLE_LANES + n - 1) / n * PARTICLE_LANES;
+  *lo = MIN(i * per, particles.n);
+  *hi = MIN(*lo + per, particles.n);
+}
+
+/* Particle i in its generation'th life takes numbers 4i to 4i + 3 of
+   that generation's stream, so particles can be made in any order, on
+   any thread, and come out the same. */
+static void init_particle(int i, int generation) {
+  struct rng r = rand_stream(RAND_PARTICLES + generation);
+  rand_seek(&r, (uint64_t) i * 4);
+  particles.x[i] = rand_below(&r, screen.width);
+  particles.y[i] = rand_below(&r, screen.height);
+  particles.vx[i] = (float) rand_below(&r, 200) / 100 - 1;
+  particles.vy[i] = (float) rand_below(&r, 200) / 100 - 1;
+  particles.vx[i] *= VEL_SCALE;
+  particles.vy[i] *= VEL_SCALE;
+}
+
+static void init_particles(int i, int n) {
+  int lo, hi, c;
+  slice_of(i, n, &lo, &hi);
+  for (c = lo; c < hi; c++) {
+    if (c < n_particles) {
+      init_particle(c, 0);
+    } else {
+      particles.x[c] = particles.y[c] = DEAD_PARTICLE_MARKER;
+      particles.vx[c] = particles.vy[c] = 0;
+    }
+  }
+}
+
+static void setup_particles(void) {
+  const char *s = getenv("LFLOW_PARTICLES");
+  size_t array;
+  char *arena;
+
+  n_particles = s ? atoi(s) : N_PARTICLES;
+  if (n_particles < 1) {
+    fprintf(stderr, "LFLOW_PARTICLES=%s makes no sense\n", s);
     exit(1);
   }
-  if (ioctl(fb, FBIOGET_FSCREENINFO, &f) < 0) {
-    perror("ioctl FBIOGET_FSCREENINFO");
-    close(fb);
+  n_slots = (n_particles + PARTICLE_LANES - 1) & ~(PARTICLE_LANES - 1);
+
+  /* all the arrays come out of one mapping, each starting on a cache line */
+  array = (n_slots * sizeof(float) + 63) & ~(size_t) 63;
+  arena = arena_alloc(7 * array);
+  particles.x = (float *) (arena + 0 * array);
+  particles.y = (float *) (arena + 1 * array);
+  particles.vx = (float *) (arena + 2 * array);
+  particles.vy = (float *) (arena + 3 * array);
+  particles.pix = (int32_t *) (arena + 4 * array);
+  particles.col = (int32_t *) (arena + 5 * array);
+#if ERASE_TRACKS
+  particles.old = (int32_t *) (arena + 6 * array);
+#endif
+
+  particles.n = n_slots;
+  particles.live = n_particles;
+  pool_run(init_particles);
+}
+
+#if !WANT_REPLACEMENTS
+/* Squeezes out the dead particles, once there are enough of them to
+   be worth it. */
+static void compact_particles(void) {
+  int c, n = 0;
+
+  if (particles.n - particles.live < particles.n / 8) return;
+
+  for (c = 0; c < particles.n; c++) {
+    if (particles.x[c] != DEAD_PARTICLE_MARKER) {
+      particles.x[n] = particles.x[c];
+      particles.y[n] = particles.y[c];
+      particles.vx[n] = particles.vx[c];
+      particles.vy[n] = particles.vy[c];
+      n++;
+    }
+  }
+  particles.live = n;
+  for (; n & (PARTICLE_LANES - 1); n++) {
+    particles.x[n] = particles.y[n] = DEAD_PARTICLE_MARKER;
+    particles.vx[n] = particles.vy[n] = 0;
+  }
+  particles.n = n;
+}
+#endif
+
+#define PACK_PIXEL(x, y) (((int32_t) (y) << 16) | (int32_t) (x))
+
+/* The reference version, and the one used when the CPU has nothing
+   better. Like the others, returns how many particles died. */
+static int integrate_scalar(int lo, int hi) {
+  int c;
+  int died = 0;
+  for (c = lo; c < hi; c++) {
+    float x = particles.x[c];
+    float y = particles.y[c];
+    float vx = particles.vx[c];
+    float vy = particles.vy[c];
+    int bodynum;
+    int color_index;
+
+    particles.pix[c] = -1;
+#if ERASE_TRACKS
+    particles.old[c] = (x >= 0 && y >= 0 && x < screen.width && y < screen.height) ? PACK_PIXEL(x, y) : -1;
+#endif
+
+    if (x == DEAD_PARTICLE_MARKER)
+      continue;
+
+    for (bodynum = 0; bodynum < N_MASSES; bodynum++) {
+      float dx = masses[bodynum].x - x;
+      float dy = masses[bodynum].y - y;
+      float m = dx * dx + dy * dy;
+      float k = masses[bodynum].mass / (m * sqrt(m));
+      float dvx = k * dx;
+      float dvy = k * dy;
+      if (m < MASS_CLIP) {
+	particles.x[c] = DEAD_PARTICLE_MARKER;
+	died++;
+	goto done_particle;
+      }
+      vx += dvx;
+      vy += dvy;
+    }
+
+    color_index = sqrt(vx * vx + vy * vy) * 200;
+    if (color_index > MAX_COLOR) color_index = MAX_COLOR;
+    if (color_index < 1) color_index = 1; /* stay inside colors[] when stopped dead */
+    color_index = MAX_COLOR - color_index;
+
+    x = x + vx;
+    y = y + vy;
+    /* A particle that lands right on a mass comes out as NaN. */
+    if ((x < 0) || (y < 0) || (x >= screen.width) || (y >= screen.height) || x != x || y != y) {
+      if ((x < -screen.width) || (y < -screen.height) || (x >= screen.width * 2) || (y > screen.height * 2)
+	  || x != x || y != y) {
+	x = DEAD_PARTICLE_MARKER;
+	died++;
+      }
+    } else {
+      particles.pix[c] = PACK_PIXEL(x, y);
+      particles.col[c] = color_index;
+    }
+    particles.x[c] = x;
+    particles.y[c] = y;
+    particles.vx[c] = vx;
+    particles.vy[c] = vy;
+  done_particle:
+    continue;
+  }
+  return died;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/* 8 particles at a time. 1/sqrt comes from rsqrt plus a Newton step,
+   so the answers differ from the scalar version in the last bits. */
+__attribute__((target("avx2,fma")))
+static int integrate_avx2(int lo, int hi) {
+  const __m256 width = _mm256_set1_ps(screen.width);
+  const __m256 height = _mm256_set1_ps(screen.height);
+  const __m256 zero = _mm256_setzero_ps();
+  const __m256 marker = _mm256_set1_ps(DEAD_PARTICLE_MARKER);
+  const __m256 half = _mm256_set1_ps(0.5f);
+  const __m256 three_halves = _mm256_set1_ps(1.5f);
+  const __m256 clip = _mm256_set1_ps(MASS_CLIP);
+  const __m256i max_color = _mm256_set1_epi32(MAX_COLOR);
+  const __m256i one = _mm256_set1_epi32(1);
+  int c, bodynum;
+  int died = 0;
+
+  for (c = lo; c < hi; c += 8) {
+    __m256 x = _mm256_load_ps(particles.x + c);
+    __m256 y = _mm256_load_ps(particles.y + c);
+    __m256 vx = _mm256_load_ps(particles.vx + c);
+    __m256 vy = _mm256_load_ps(particles.vy + c);
+    __m256 live = _mm256_cmp_ps(x, marker, _CMP_NEQ_OQ);
+    __m256 killed = zero;
+    __m256 nx, ny, inside, far, speed;
+    __m256i ci, pix;
+
+#if ERASE_TRACKS
+    inside = _mm256_and_ps(_mm256_and_ps(_mm256_cmp_ps(x, zero, _CMP_GE_OQ), _mm256_cmp_ps(y, zero, _CMP_GE_OQ)),
+			   _mm256_and_ps(_mm256_cmp_ps(x, width, _CMP_LT_OQ), _mm256_cmp_ps(y, height, _CMP_LT_OQ)));
+    pix = _mm256_or_si256(_mm256_slli_epi32(_mm256_cvttps_epi32(y), 16), _mm256_cvttps_epi32(x));
+    _mm256_store_si256((__m256i *) (particles.old + c),
+		       _mm256_blendv_epi8(_mm256_set1_epi32(-1), pix, _mm256_castps_si256(inside)));
+#endif
+
+    if (_mm256_testz_ps(live, live)) {
+      _mm256_store_si256((__m256i *) (particles.pix + c), _mm256_set1_epi32(-1));
+      continue;
+    }
+
+    for (bodynum = 0; bodynum < N_MASSES; bodynum++) {
+      __m256 dx = _mm256_sub_ps(_mm256_set1_ps(masses[bodynum].x), x);
+      __m256 dy = _mm256_sub_ps(_mm256_set1_ps(masses[bodynum].y), y);
+      __m256 m = _mm256_fmadd_ps(dx, dx, _mm256_mul_ps(dy, dy));
+      __m256 r = _mm256_rsqrt_ps(m);
+      __m256 k;
+      r = _mm256_mul_ps(r, _mm256_fnmadd_ps(_mm256_mul_ps(half, m), _mm256_mul_ps(r, r), three_halves));
+      k = _mm256_mul_ps(_mm256_set1_ps(masses[bodynum].mass), _mm256_mul_ps(r, _mm256_mul_ps(r, r)));
+      killed = _mm256_or_ps(killed, _mm256_and_ps(live, _mm256_cmp_ps(m, clip, _CMP_LT_OQ)));
+      live = _mm256_andnot_ps(killed, live);
+      vx = _mm256_blendv_ps(vx, _mm256_fmadd_ps(k, dx, vx), live);
+      vy = _mm256_blendv_ps(vy, _mm256_fmadd_ps(k, dy, vy), live);
+    }
+
+    speed = _mm256_sqrt_ps(_mm256_fmadd_ps(vx, vx, _mm256_mul_ps(vy, vy)));
+    ci = _mm256_cvttps_epi32(_mm256_mul_ps(speed, _mm256_set1_ps(200)));
+    ci = _mm256_sub_epi32(max_color, _mm256_max_epi32(_mm256_min_epi32(ci, max_color), one));
+
+    nx = _mm256_add_ps(x, vx);
+    ny = _mm256_add_ps(y, vy);
+    inside = _mm256_and_ps(_mm256_and_ps(_mm256_cmp_ps(nx, zero, _CMP_GE_OQ), _mm256_cmp_ps(ny, zero, _CMP_GE_OQ)),
+			   _mm256_and_ps(_mm256_cmp_ps(nx, width, _CMP_LT_OQ), _mm256_cmp_ps(ny, height, _CMP_LT_OQ)));
+    inside = _mm256_and_ps(inside, live);
+    far = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(nx, _mm256_sub_ps(zero, width), _CMP_LT_OQ),
+				    _mm256_cmp_ps(ny, _mm256_sub_ps(zero, height), _CMP_LT_OQ)),
+		       _mm256_or_ps(_mm256_cmp_ps(nx, _mm256_add_ps(width, width), _CMP_GE_OQ),
+				    _mm256_cmp_ps(ny, _mm256_add_ps(height, height), _CMP_GT_OQ)));
+    far = _mm256_or_ps(far, _mm256_cmp_ps(nx, ny, _CMP_UNORD_Q));
+    far = _mm256_and_ps(far, live);
+
+    pix = _mm256_or_si256(_mm256_slli_epi32(_mm256_cvttps_epi32(ny), 16), _mm256_cvttps_epi32(nx));
+    _mm256_store_si256((__m256i *) (particles.pix + c),
+		       _mm256_blendv_epi8(_mm256_set1_epi32(-1), pix, _mm256_castps_si256(inside)));
+    _mm256_store_si256((__m256i *) (particles.col + c), ci);
+
+    x = _mm256_blendv_ps(x, nx, live);
+    y = _mm256_blendv_ps(y, ny, live);
+    x = _mm256_blendv_ps(x, marker, _mm256_or_ps(far, killed));
+    died += __builtin_popcount(_mm256_movemask_ps(_mm256_or_ps(far, killed)));
+    _mm256_store_ps(particles.x + c, x);
+    _mm256_store_ps(particles.y + c, y);
+    _mm256_store_ps(particles.vx + c, vx);
+    _mm256_store_ps(particles.vy + c, vy);
+  }
+  return died;
+}
+
+/* 16 particles at a time, with mask registers. */
+__attribute__((target("avx512f")))
+static int integrate_avx512(int lo, int hi) {
+  const __m512 width = _mm512_set1_ps(screen.width);
+  const __m512 height = _mm512_set1_ps(screen.height);
+  const __m512 zero = _mm512_setzero_ps();
+  const __m512 marker = _mm512_set1_ps(DEAD_PARTICLE_MARKER);
+  const __m512 half = _mm512_set1_ps(0.5f);
+  const __m512 three_halves = _mm512_set1_ps(1.5f);
+  const __m512 clip = _mm512_set1_ps(MASS_CLIP);
+  const __m512i max_color = _mm512_set1_epi32(MAX_COLOR);
+  const __m512i one = _mm512_set1_epi32(1);
+  const __m512i none = _mm512_set1_epi32(-1);
+  int c, bodynum;
+  int died = 0;
+
+  for (c = lo; c < hi; c += 16) {
+    __m512 x = _mm512_load_ps(particles.x + c);
+    __m512 y = _mm512_load_ps(particles.y + c);
+    __m512 vx = _mm512_load_ps(particles.vx + c);
+    __m512 vy = _mm512_load_ps(particles.vy + c);
+    __mmask16 live = _mm512_cmp_ps_mask(x, marker, _CMP_NEQ_OQ);
+    __mmask16 killed = 0;
+    __mmask16 inside, far;
+    __m512 nx, ny, speed;
+    __m512i ci, pix;
+
+#if ERASE_TRACKS
+    inside = _mm512_cmp_ps_mask(x, zero, _CMP_GE_OQ) & _mm512_cmp_ps_mask(y, zero, _CMP_GE_OQ)
+      & _mm512_cmp_ps_mask(x, width, _CMP_LT_OQ) & _mm512_cmp_ps_mask(y, height, _CMP_LT_OQ);
+    pix = _mm512_or_si512(_mm512_slli_epi32(_mm512_cvttps_epi32(y), 16), _mm512_cvttps_epi32(x));
+    _mm512_store_si512(particles.old + c, _mm512_mask_blend_epi32(inside, none, pix));
+#endif
+
+    if (!live) {
+      _mm512_store_si512(particles.pix + c, none);
+      continue;
+    }
+
+    for (bodynum = 0; bodynum < N_MASSES; bodynum++) {
+      __m512 dx = _mm512_sub_ps(_mm512_set1_ps(masses[bodynum].x), x);
+      __m512 dy = _mm512_sub_ps(_mm512_set1_ps(masses[bodynum].y), y);
+      __m512 m = _mm512_fmadd_ps(dx, dx, _mm512_mul_ps(dy, dy));
+      __m512 r = _mm512_rsqrt14_ps(m);
+      __m512 k;
+      r = _mm512_mul_ps(r, _mm512_fnmadd_ps(_mm512_mul_ps(half, m), _mm512_mul_ps(r, r), three_halves));
+      k = _mm512_mul_ps(_mm512_set1_ps(masses[bodynum].mass), _mm512_mul_ps(r, _mm512_mul_ps(r, r)));
+      killed |= live & _mm512_cmp_ps_mask(m, clip, _CMP_LT_OQ);
+      live &= ~killed;
+      vx = _mm512_mask_fmadd_ps(k, live, dx, vx);
+      vy = _mm512_mask_fmadd_ps(k, live, dy, vy);
+    }
+
+    speed = _mm512_sqrt_ps(_mm512_fmadd_ps(vx, vx, _mm512_mul_ps(vy, vy)));
+    ci = _mm512_cvttps_epi32(_mm512_mul_ps(speed, _mm512_set1_ps(200)));
+    ci = _mm512_sub_epi32(max_color, _mm512_max_epi32(_mm512_min_epi32(ci, max_color), one));
+
+    nx = _mm512_add_ps(x, vx);
+    ny = _mm512_add_ps(y, vy);
+    inside = live & _mm512_cmp_ps_mask(nx, zero, _CMP_GE_OQ) & _mm512_cmp_ps_mask(ny, zero, _CMP_GE_OQ)
+      & _mm512_cmp_ps_mask(nx, width, _CMP_LT_OQ) & _mm512_cmp_ps_mask(ny, height, _CMP_LT_OQ);
+    far = live & (_mm512_cmp_ps_mask(nx, _mm512_sub_ps(zero, width), _CMP_LT_OQ)
+		  | _mm512_cmp_ps_mask(ny, _mm512_sub_ps(zero, height), _CMP_LT_OQ)
+		  | _mm512_cmp_ps_mask(nx, _mm512_add_ps(width, width), _CMP_GE_OQ)
+		  | _mm512_cmp_ps_mask(ny, _mm512_add_ps(height, height), _CMP_GT_OQ)
+		  | _mm512_cmp_ps_mask(nx, ny, _CMP_UNORD_Q));
+
+    pix = _mm512_or_si512(_mm512_slli_epi32(_mm512_cvttps_epi32(ny), 16), _mm512_cvttps_epi32(nx));
+    _mm512_store_si512(particles.pix + c, _mm512_mask_blend_epi32(inside, none, pix));
+    _mm512_store_si512(particles.col + c, ci);
+
+    x = _mm512_mask_blend_ps(live, x, nx);
+    y = _mm512_mask_blend_ps(live, y, ny);
+    x = _mm512_mask_blend_ps(far | killed, x, marker);
+    died += __builtin_popcount(far | killed);
+    _mm512_store_ps(particles.x + c, x);
+    _mm512_store_ps(particles.y + c, y);
+    _mm512_store_ps(particles.vx + c, vx);
+    _mm512_store_ps(particles.vy + c, vy);
+  }
+  return died;
+}
+#endif
+
+static int (*integrate)(int lo, int hi) = integrate_scalar;
+
+#if WANT_DENSITY
+/* Instead of each particle painting its pixel over whatever was there,
+   particles add to a 16-bit count per pixel, faster ones adding more.
+   Once a frame the counts decay a little and are turned into colours
+   through tone_lut[], which follows colors[] on a log scale, so the
+   screen shows where particles bunch up. Only rows with something in
+   them are looked at. */
+#define DENSITY_HIT 16        /* what a stopped particle adds */
+#define DENSITY_DECAY 5       /* counts lose 1/32 a frame */
+#define TONE_SHIFT 4          /* tone_lut[] has 4096 entries */
+
+#if WANT_LAZY_FADE || WANT_INDEXED
+#error "WANT_DENSITY does its own fading and drawing; turn off WANT_LAZY_FADE and WANT_INDEXED"
+#endif
+
+static struct density {
+  uint16_t *count;            /* width * height */
+  uint8_t *row_lit;           /* rows with a nonzero count */
+  uint32_t tone_lut[65536 >> TONE_SHIFT];
+  int (*resolve_row)(uint32_t *dst, uint16_t *count, int n);
+} density;
+
+/* Decays a row of counts and colours it in; says if any are left. */
+static int density_resolve_scalar(uint32_t *dst, uint16_t *count, int n) {
+  int x, any = 0;
+  for (x = 0; x < n; x++) {
+    int d = count[x];
+    d -= MIN(d + (1 << DENSITY_DECAY) - 1, 65535) >> DENSITY_DECAY;
+    count[x] = d;
+    dst[x] = density.tone_lut[d >> TONE_SHIFT];
+    any |= d;
+  }
+  return any != 0;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+static int density_resolve_avx2(uint32_t *dst, uint16_t *count, int n) {
+  const __m256i round = _mm256_set1_epi16((1 << DENSITY_DECAY) - 1);
+  __m256i any = _mm256_setzero_si256();
+  int x;
+  for (x = 0; x + 16 <= n; x += 16) {
+    __m256i d = _mm256_loadu_si256((__m256i *) (count + x));
+    __m256i lo, hi;
+    d = _mm256_sub_epi16(d, _mm256_srli_epi16(_mm256_adds_epu16(d, round), DENSITY_DECAY));
+    _mm256_storeu_si256((__m256i *) (count + x), d);
+    any = _mm256_or_si256(any, d);
+    lo = _mm256_srli_epi32(_mm256_cvtepu16_epi32(_mm256_castsi256_si128(d)), TONE_SHIFT);
+    hi = _mm256_srli_epi32(_mm256_cvtepu16_epi32(_mm256_extracti128_si256(d, 1)), TONE_SHIFT);
+    _mm256_storeu_si256((__m256i *) (dst + x), _mm256_i32gather_epi32((int *) density.tone_lut, lo, 4));
+    _mm256_storeu_si256((__m256i *) (dst + x + 8), _mm256_i32gather_epi32((int *) density.tone_lut, hi, 4));
+  }
+  x = density_resolve_scalar(dst + x, count + x, n - x);
+  return x || !_mm256_testz_si256(any, any);
+}
+#endif
+
+static void density_resolve(int i, int n) {
+  int y;
+  TRACE_SCOPE("density_resolve");
+  for (y = i * screen.height / n; y < (i + 1) * screen.height / n; y++) {
+    if (density.row_lit[y]) {
+      density.row_lit[y] = density.resolve_row(&screen.shadow[y * screen.stride],
+					       &density.count[y * screen.width], screen.width);
+      damage(0, screen.width - 1, y);
+    }
+  }
+}
+
+static void setup_density(void) {
+  int k;
+
+  density.count = calloc((size_t) screen.width * screen.height, sizeof(uint16_t));
+  density.row_lit = calloc(screen.height, 1);
+  if (density.count == NULL || density.row_lit == NULL) {
+    perror("calloc");
     exit(1);
   }
-  if (ioctl(fb, FBIOGET_VSCREENINFO, &v) < 0) {
-    perror("ioctl FBIOGET_VSCREENINFO");
-    close(fb);
+  density.tone_lut[0] = 0;
+  for (k = 1; k < (65536 >> TONE_SHIFT); k++) {
+    double t = log2(1 + k) / log2(65536 >> TONE_SHIFT);
+    density.tone_lut[k] = colors[(int) ((MAX_COLOR - 1) * (1 - t))];
+  }
+
+  density.resolve_row = density_resolve_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+  if (__builtin_cpu_supports("avx2")) density.resolve_row = density_resolve_avx2;
+#endif
+}
+
+static void plot(int x, int y, int col) {
+  uint16_t *d = &density.count[y * screen.width + x];
+  *d = MIN(*d + DENSITY_HIT + ((MAX_COLOR - col) >> 2), 65535);
+  density.row_lit[y] = 1;
+}
+#elif WANT_INDEXED
+/* Instead of a 32-bit shadow, pixels are 16-bit indices standing for
+   colors[] and all the faded versions of them: 48256 colours for the
+   usual ones. Each colour is followed down as it fades, and the
+   colours met on the way are numbered one after another, in blocks of
+   PALETTE_BLOCK, so that within a block
+
+     colour of index i = block[i / PALETTE_BLOCK] less i % PALETTE_BLOCK from each channel
+     fading index i    = i + 1
+
+   and only the last index in a block fades to somewhere else, next[]
+   of the block. The block table is small enough to stay in the L1
+   cache. present_and_fade() works out the colours as it copies them
+   to the screen, so that the only 32-bit pixels are the screen's own,
+   and the shadow is half the size. That pays where memory bandwidth is
+   short; where the 32-bit shadow sits in the cache anyway, working out
+   the colours costs more than it saves. */
+#define PALETTE_SHIFT 5
+#define PALETTE_BLOCK (1 << PALETTE_SHIFT)
+#define PALETTE_BLOCKS (65536 >> PALETTE_SHIFT)
+#define PALETTE_HASH_BITS 17
+
+#if !WANT_FADE || WANT_LAZY_FADE
+#error "WANT_INDEXED does the eager fade itself; turn on WANT_FADE and off WANT_LAZY_FADE"
+#endif
+
+static struct indexed {
+  uint16_t *pix;                  /* width * height */
+  uint32_t block[PALETTE_BLOCKS]; /* the first colour, and how many are used in the top byte */
+  uint32_t next[PALETTE_BLOCKS];  /* what the last one fades to */
+  uint16_t slot[MAX_COLOR];       /* the indices of colors[] */
+  int n_blocks;
+  void (*present)(uint32_t *dst, uint16_t *src, size_t n);
+} indexed;
+
+static uint32_t palette_colour(int i) {
+  uint32_t c = indexed.block[i >> PALETTE_SHIFT];
+  int k = i & (PALETTE_BLOCK - 1);
+  return (MAX((int) ((c >> 16) & 0xff) - k, 0) << 16) | (MAX((int) ((c >> 8) & 0xff) - k, 0) << 8) | MAX((int) (c & 0xff) - k, 0);
+}
+
+static int palette_fade(int i) {
+  int b = i >> PALETTE_SHIFT;
+  return (i & (PALETTE_BLOCK - 1)) + 1 < (int) (indexed.block[b] >> 24) ? i + 1 : (int) indexed.next[b];
+}
+
+/* Copies n pixels to dst in colour, and fades them where they are. */
+static void indexed_present_scalar(uint32_t *dst, uint16_t *src, size_t n) {
+  size_t i;
+  for (i = 0; i < n; i++) {
+    dst[i] = palette_colour(src[i]);
+    src[i] = palette_fade(src[i]);
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+static void indexed_present_avx2(uint32_t *dst, uint16_t *src, size_t n) {
+  const __m256i colour = _mm256_set1_epi32(0x00ffffff);
+  const __m256i offset = _mm256_set1_epi32(PALETTE_BLOCK - 1);
+  const __m256i spread = _mm256_set1_epi32(0x00010101);
+  const __m256i one = _mm256_set1_epi32(1);
+  const __m256i zero = _mm256_setzero_si256();
+  size_t i = MIN(n, (-(uintptr_t) dst & 31) / sizeof(uint32_t));
+  indexed_present_scalar(dst, src, i);
+  for (; i + 8 <= n; i += 8) {
+    __m128i s = _mm_loadu_si128((__m128i *) (src + i));
+    __m256i p, b, k, c, lit, ends;
+    if (_mm_testz_si128(s, s)) {
+      _mm256_stream_si256((__m256i *) (dst + i), zero);
+      continue;
+    }
+    p = _mm256_cvtepu16_epi32(s);
+    b = _mm256_srli_epi32(p, PALETTE_SHIFT);
+    k = _mm256_and_si256(p, offset);
+    c = _mm256_i32gather_epi32((int *) indexed.block, b, 4);
+    _mm256_stream_si256((__m256i *) (dst + i),
+			_mm256_subs_epu8(_mm256_and_si256(c, colour), _mm256_mullo_epi32(k, spread)));
+    /* Black (0) stays put; the ends of blocks look up where they go. */
+    lit = _mm256_xor_si256(_mm256_cmpeq_epi32(p, zero), _mm256_cmpeq_epi32(zero, zero));
+    ends = _mm256_and_si256(lit, _mm256_xor_si256(_mm256_cmpgt_epi32(_mm256_srli_epi32(c, 24), _mm256_add_epi32(k, one)),
+						  _mm256_cmpeq_epi32(zero, zero)));
+    p = _mm256_sub_epi32(p, _mm256_andnot_si256(ends, lit));
+    if (!_mm256_testz_si256(ends, ends)) {
+      p = _mm256_mask_i32gather_epi32(p, (int *) indexed.next, b, ends, 4);
+    }
+    _mm_storeu_si128((__m128i *) (src + i),
+		     _mm_packus_epi32(_mm256_castsi256_si128(p), _mm256_extracti128_si256(p, 1)));
+  }
+  indexed_present_scalar(dst + i, src + i, n - i);
+  _mm_sfence();
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void indexed_present_avx512(uint32_t *dst, uint16_t *src, size_t n) {
+  const __m512i colour = _mm512_set1_epi32(0x00ffffff);
+  const __m512i offset = _mm512_set1_epi32(PALETTE_BLOCK - 1);
+  const __m512i spread = _mm512_set1_epi32(0x00010101);
+  const __m512i one = _mm512_set1_epi32(1);
+  size_t i = MIN(n, (-(uintptr_t) dst & 63) / sizeof(uint32_t));
+  indexed_present_scalar(dst, src, i);
+  for (; i + 16 <= n; i += 16) {
+    __m256i s = _mm256_loadu_si256((__m256i *) (src + i));
+    __m512i p, b, k, c;
+    __mmask16 lit, ends;
+    if (_mm256_testz_si256(s, s)) {
+      _mm512_stream_si512((void *) (dst + i), _mm512_setzero_si512());
+      continue;
+    }
+    p = _mm512_cvtepu16_epi32(s);
+    b = _mm512_srli_epi32(p, PALETTE_SHIFT);
+    k = _mm512_and_si512(p, offset);
+    c = _mm512_i32gather_epi32(b, (void *) indexed.block, 4);
+    _mm512_stream_si512((void *) (dst + i),
+			_mm512_subs_epu8(_mm512_and_si512(c, colour), _mm512_mullo_epi32(k, spread)));
+    /* Black (0) stays put; the ends of blocks look up where they go. */
+    lit = _mm512_test_epi32_mask(p, p);
+    ends = _mm512_mask_cmple_epi32_mask(lit, _mm512_srli_epi32(c, 24), _mm512_add_epi32(k, one));
+    p = _mm512_mask_add_epi32(p, lit & ~ends, p, one);
+    if (ends) {
+      p = _mm512_mask_i32gather_epi32(p, ends, b, (void *) indexed.next, 4);
+    }
+    _mm256_storeu_si256((__m256i *) (src + i), _mm512_cvtepi32_epi16(p));
+  }
+  indexed_present_scalar(dst + i, src + i, n - i);
+  _mm_sfence();
+}
+#endif
+
+/* Finds colour c, adding it as index i if it's new and i isn't -1. */
+static int palette_index(uint32_t *hash, uint32_t c, int i) {
+  uint32_t h = (c * 0x9e3779b1u) >> (32 - PALETTE_HASH_BITS);
+
+  while (hash[h]) {
+    if (palette_colour(hash[h] - 1) == c) return hash[h] - 1;
+    h = (h + 1) & ((1 << PALETTE_HASH_BITS) - 1);
+  }
+  if (i >= 0) hash[h] = i + 1;
+  return i;
+}
+
+static void setup_indexed(void) {
+  uint32_t *hash = calloc(1 << PALETTE_HASH_BITS, sizeof(uint32_t));
+  int col;
+
+  if (!fade_decrements) {
+    fprintf(stderr, "WANT_INDEXED needs a FADE_FACTOR that takes one off each channel\n");
     exit(1);
   }
-  screen.base = mmap(NULL, f.smem_len, PROT_READ | PROT_WRITE, MAP_SHARED, fb, 0);
-  if (screen.base == NULL) {
-    perror("mmap");
-    close(fb);
+  indexed.pix = calloc((size_t) screen.width * screen.height, sizeof(uint16_t));
+  if (hash == NULL || indexed.pix == NULL) {
+    perror("calloc");
     exit(1);
   }
-  screen.stride = f.line_length / sizeof(uint32_t);
-  screen.width = v.xres;
-  screen.height = v.yres;
-  screen.shadow = malloc(screen.stride * screen.height * sizeof(uint32_t));
+
+  /* Black is 0, and fades to itself. */
+  indexed.block[0] = 1 << 24;
+  indexed.n_blocks = 1;
+  palette_index(hash, 0, 0);
+
+  for (col = 0; col < MAX_COLOR; col++) {
+    uint32_t c = colors[col];
+    int i = palette_index(hash, c, -1);
+
+    if (i < 0) {
+      /* A new colour: follow it down until it joins a known one. */
+      int b = -1, k = PALETTE_BLOCK, j;
+      i = indexed.n_blocks << PALETTE_SHIFT;
+      while ((j = palette_index(hash, c, -1)) < 0) {
+	if (k == PALETTE_BLOCK) {
+	  if (indexed.n_blocks == PALETTE_BLOCKS) {
+	    fprintf(stderr, "WANT_INDEXED: too many colours for 16 bits\n");
+	    exit(1);
+	  }
+	  if (b >= 0) indexed.next[b] = indexed.n_blocks << PALETTE_SHIFT;
+	  b = indexed.n_blocks++;
+	  indexed.block[b] = c;
+	  k = 0;
+	}
+	indexed.block[b] = (indexed.block[b] & 0x00ffffff) | (uint32_t) (k + 1) << 24;
+	palette_index(hash, c, (b << PALETTE_SHIFT) + k);
+	k++;
+	c = fade_pixel(c);
+      }
+      indexed.next[b] = j;
+    }
+    indexed.slot[col] = i;
+  }
+  free(hash);
+
+  indexed.present = indexed_present_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+  if (__builtin_cpu_supports("avx2")) indexed.present = indexed_present_avx2;
+  if (__builtin_cpu_supports("avx512bw")) indexed.present = indexed_present_avx512;
+#endif
 }
 
-static void init_particle(struct particle *p) {
-  p->x = random() % screen.width;
-  p->y = random() % screen.height;
-  p->vx = (float)(random() % 200) / 100 - 1;
-  p->vy = (float)(random() % 200) / 100 - 1;
-  p->vx *= VEL_SCALE;
-  p->vy *= VEL_SCALE;
+static void plot(int x, int y, int col) {
+  indexed.pix[y * screen.width + x] = indexed.slot[col];
+  damage(x, x, y);
 }
 
-static void setup_particles(void) {
-  int i;
-  for (i = 0; i < N_PARTICLES; i++) {
-    init_particle(&particles[i]);
+static void unplot(int x, int y) {
+  indexed.pix[y * screen.width + x] = 0;
+  damage(x, x, y);
+}
+#else
+static void plot(int x, int y, int col) {
+  uint32_t c = colors[col];
+#if WANT_FADE && WANT_LAZY_FADE
+  row_drawn[y] = frame_counter;
+  c |= (uint32_t) frame_counter << 24;
+#endif
+  putpixel(x, y, c);
+}
+#endif
+
+#if !WANT_INDEXED
+static void unplot(int x, int y) {
+  putpixel(x, y, 0);
+}
+#endif
+
+/* The particle update runs on the thread pool in three steps:
+
+   1. each thread integrates its own slice of the particles, and
+      counts how many pixels it will write in each 64x64 tile;
+   2. each thread copies its writes into the tiles, at offsets worked
+      out so that within a tile they are in particle order;
+   3. each thread draws whole rows of tiles, a tile at a time.
+
+   Every pixel is therefore written by the same particles in the same
+   order as a plain loop would, the last particle winning, however many
+   threads there are. Drawing a tile at a time keeps the writes within
+   a few pages of the shadow buffer, where a plain loop scatters them
+   over all of it. Sorting isn't free, though, and until there are
+   enough particles to miss the cache and TLB on most writes, a single
+   thread does better drawing the particles in order as it goes.
+   With more than one thread, the physics is tiled whatever the number
+   of particles, since that is how it is shared out. LFLOW_TILES=1 or 0
+   overrides the choice either way; 0 leaves the physics to one thread
+   while the rest of the frame still uses them all.
+
+   Either way, tile_drawn[] notes which tiles were drawn on, which lets
+   the fade skip tiles that have had time to go dark. */
+#define TILE_SHIFT 6
+#define TILE_SIZE (1 << TILE_SHIFT)
+#define TILE_MIN_PARTICLES 500000
+
+/* A write, packed as its colour above its place in the tile; the tile
+   itself is implied by where the write is filed. */
+#define SPLAT_COL_SHIFT (2 * TILE_SHIFT)
+#define SPLAT_ERASE MAX_COLOR
+
+static uint32_t *splats;
+
+static int tiles_x, tiles_y, n_tiles;
+static int *tile_count;  /* [thread][tile]; offsets into splats[] after step 1 */
+static int *tile_start;  /* [tile], plus the total at the end */
+static int *tile_drawn;  /* [tile], the last frame anything was drawn there */
+static int tiled;
+static int slice_died[POOL_MAX_THREADS];
+
+static int tile_of(int32_t pix) {
+  return (pix >> (16 + TILE_SHIFT)) * tiles_x + ((pix & 0xffff) >> TILE_SHIFT);
+}
+
+static uint32_t splat(int32_t pix, int col) {
+  return (uint32_t) col << SPLAT_COL_SHIFT | ((pix >> 16) & (TILE_SIZE - 1)) << TILE_SHIFT | (pix & (TILE_SIZE - 1));
+}
+
+static void physics_integrate(int i, int n) {
+  int *count = tile_count + i * n_tiles;
+  int lo, hi, c;
+
+  slice_of(i, n, &lo, &hi);
+  slice_died[i] = integrate(lo, hi);
+  memset(count, 0, n_tiles * sizeof(int));
+  for (c = lo; c < hi; c++) {
+    if (particles.pix[c] >= 0) count[tile_of(particles.pix[c])]++;
+#if ERASE_TRACKS
+    if (particles.old[c] >= 0) count[tile_of(particles.old[c])]++;
+#endif
+  }
+}
+
+static void physics_bin(int i, int n) {
+  int *next = tile_count + i * n_tiles;
+  int lo, hi, c;
+
+  slice_of(i, n, &lo, &hi);
+  for (c = lo; c < hi; c++) {
+    int32_t pix = particles.pix[c];
+    if (pix >= 0) {
+      splats[next[tile_of(pix)]++] = splat(pix, particles.col[c]);
+    }
+#if ERASE_TRACKS
+    pix = particles.old[c];
+    if (pix >= 0) {
+      splats[next[tile_of(pix)]++] = splat(pix, SPLAT_ERASE);
+    }
+#endif
+  }
+}
+
+/* The counting sort's prefix sum, tile by tile and within a tile
+   thread by thread, so that each tile's writes stay in particle order. */
+static void physics_offsets(void) {
+  int t, c, pos = 0;
+
+  for (t = 0; t < n_tiles; t++) {
+    tile_start[t] = pos;
+    for (c = 0; c < pool.n; c++) {
+      int count = tile_count[c * n_tiles + t];
+      tile_count[c * n_tiles + t] = pos;
+      pos += count;
+    }
+  }
+  tile_start[n_tiles] = pos;
+}
+
+static void physics_serial(void) {
+  int c;
+  particles.live -= integrate(0, particles.n);
+  for (c = 0; c < particles.n; c++) {
+    int32_t pix = particles.pix[c];
+    if (pix >= 0) {
+      tile_drawn[tile_of(pix)] = frame_counter;
+      plot(pix & 0xffff, pix >> 16, particles.col[c]);
+    }
+#if ERASE_TRACKS
+    pix = particles.old[c];
+    if (pix >= 0) {
+      tile_drawn[tile_of(pix)] = frame_counter;
+      unplot(pix & 0xffff, pix >> 16);
+    }
+#endif
+  }
+}
+
+static void physics_draw(int i, int n) {
+  int ty, tx, k;
+  for (ty = i; ty < tiles_y; ty += n) {
+    for (tx = 0; tx < tiles_x; tx++) {
+      int t = ty * tiles_x + tx;
+      int x0 = tx << TILE_SHIFT;
+      int y0 = ty << TILE_SHIFT;
+      if (tile_start[t] == tile_start[t + 1]) continue;
+      tile_drawn[t] = frame_counter;
+      for (k = tile_start[t]; k < tile_start[t + 1]; k++) {
+	uint32_t s = splats[k];
+	int x = x0 + (s & (TILE_SIZE - 1));
+	int y = y0 + ((s >> TILE_SHIFT) & (TILE_SIZE - 1));
+	int col = s >> SPLAT_COL_SHIFT;
+	if (col != SPLAT_ERASE) {
+	  plot(x, y, col);
+	} else {
+	  unplot(x, y);
+	}
+      }
+    }
+  }
+}
+
+#if WANT_FADE && !WANT_DENSITY && !WANT_LAZY_FADE
+/* Fades row y from lo to hi, leaving out tiles that nothing has been
+   drawn on for 256 frames: a fade takes at least one off every lit
+   channel, so those are black already. */
+static void fade_row(int y, int lo, int hi) {
+  int *drawn = tile_drawn + (y >> TILE_SHIFT) * tiles_x;
+  int tx = lo >> TILE_SHIFT;
+  int last = hi >> TILE_SHIFT;
+
+  while (tx <= last) {
+    int x0, x1;
+    while (tx <= last && frame_counter - drawn[tx] >= 256) tx++;
+    if (tx > last) break;
+    x0 = MAX(tx << TILE_SHIFT, lo);
+    while (tx <= last && frame_counter - drawn[tx] < 256) tx++;
+    x1 = MIN((tx << TILE_SHIFT) - 1, hi);
+    fade_span(&screen.shadow[y * screen.stride + x0], x1 - x0 + 1);
+    damage(x0, x1, y);
+  }
+}
+#endif
+
+#if WANT_FADE && !WANT_DENSITY
+static void fade_frame(void) {
+  int y;
+
+  bench_begin(PHASE_FADE);
+  for (y = 0; y < screen.height; y++) {
+    int lo = screen.used_lo[y];
+    int hi = screen.used_hi[y];
+    if (lo <= hi) {
+#if WANT_LAZY_FADE
+      /* Rows drawn on in the last 255 frames are still fading, so
+	 must be presented again; fade_resolve() does the fading. */
+      if (frame_counter - row_drawn[y] < 256) {
+	damage(lo, hi, y);
+      } else {
+	screen.used_lo[y] = screen.width;
+	screen.used_hi[y] = -1;
+      }
+#else
+      fade_row(y, lo, hi);
+#endif
+    }
+  }
+  bench_end(PHASE_FADE);
+}
+#endif
+
+#if FUSED_FADE
+/* Presents the frame and fades the shadow for the next one in the same
+   pass, over the tiles drawn on in the last 256 frames. Those hold all
+   that can have changed since the last present: this frame's drawing,
+   and whatever the last pass faded that wasn't black already. What it
+   fades is left damaged for the next present. Page flipping needs the
+   spans of two frames, so it keeps the passes apart. */
+
+static void present_and_fade(void) {
+  int y;
+
+  for (y = 0; y < screen.height; y++) {
+    int *drawn = tile_drawn + (y >> TILE_SHIFT) * tiles_x;
+    int lo = screen.used_lo[y];
+    int hi = screen.used_hi[y];
+    int tx = lo >> TILE_SHIFT;
+    int last = hi >> TILE_SHIFT;
+
+    screen.dirty_lo[y] = screen.width;
+    screen.dirty_hi[y] = -1;
+    if (lo > hi) continue;
+    while (tx <= last) {
+      int x0, x1;
+      size_t offset;
+      while (tx <= last && frame_counter - drawn[tx] >= 256) tx++;
+      if (tx > last) break;
+      x0 = MAX(tx << TILE_SHIFT, lo);
+      while (tx <= last && frame_counter - drawn[tx] < 256) tx++;
+      x1 = MIN((tx << TILE_SHIFT) - 1, hi);
+      offset = y * screen.stride + x0;
+#if WANT_INDEXED
+      indexed.present(screen.base + offset, indexed.pix + y * screen.width + x0, x1 - x0 + 1);
+#else
+      fade_present(screen.base + offset, screen.shadow + offset, x1 - x0 + 1);
+#endif
+      damage(x0, x1, y);
+    }
+  }
+}
+#endif
+
+static void setup_physics(void) {
+  const char *s = getenv("LFLOW_TILES");
+  int t;
+
+  if (s) {
+    tiled = atoi(s);
+  } else {
+    tiled = pool.n > 1 || n_slots >= TILE_MIN_PARTICLES;
+  }
+
+  tiles_x = (screen.width + TILE_SIZE - 1) >> TILE_SHIFT;
+  tiles_y = (screen.height + TILE_SIZE - 1) >> TILE_SHIFT;
+  n_tiles = tiles_x * tiles_y;
+  tile_count = malloc(pool.n * n_tiles * sizeof(int));
+  tile_start = malloc((n_tiles + 1) * sizeof(int));
+  tile_drawn = malloc(n_tiles * sizeof(int));
+  splats = malloc(2 * (size_t) n_slots * sizeof(uint32_t));
+  if (tile_count == NULL || tile_start == NULL || tile_drawn == NULL || splats == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  for (t = 0; t < n_tiles; t++) {
+    tile_drawn[t] = -256;
+  }
+}
+
+static void setup_integrate(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) integrate = integrate_avx2;
+  if (__builtin_cpu_supports("avx512f")) integrate = integrate_avx512;
+#endif
+  if (getenv("LFLOW_SCALAR")) integrate = integrate_scalar;
+}
+
+#if WANT_NBODY
+/* Particles attracting each other, through a Barnes-Hut quadtree
+   rebuilt every frame:
+
+   1. each live particle gets a Morton key from its position, quantised
+      to 16 bits a side over a square three screens wide;
+   2. the keys are radix sorted, so every square of the tree is a run
+      of consecutive bodies;
+   3. the 4^BH_TOP squares BH_TOP levels down are built on the thread
+      pool, each as a subtree of its own, and then tied together;
+   4. the bodies walk the tree in small groups, treating any square
+      that looks smaller than theta from all of them as a single body.
+
+   Everything is done in a fixed order, so the thread count doesn't
+   change the result. */
+#define BH_THETA 0.5        /* LFLOW_THETA=x picks another */
+#define BH_LEAF 8           /* bodies a leaf may hold */
+#define BH_TOP 3
+#define BH_SOFTENING 4.0    /* pixels */
+#define PARTICLE_MASS 0.01
+
+struct bh_node {
+  float x, y;     /* centre of mass */
+  float mass;
+  float size;     /* the side of its square */
+  int leaf;
+  int lo, hi;     /* its bodies, in key order */
+  int child[4];   /* -1 for an empty quarter */
+};
+
+struct bh_nodes {
+  struct bh_node *node;
+  int n, max;
+};
+
+static struct bh {
+  float theta2;
+  float side;
+  float scale;                /* key units per pixel */
+  int shift;                  /* of the radix pass under way */
+  uint32_t *key, *key2;
+  int *order, *order2;        /* particle numbers, in key order */
+  float *bx, *by;             /* their positions, likewise */
+  int n_bodies;
+  int (*hist)[256];
+  int bucket_lo[(1 << (2 * BH_TOP)) + 1];
+  int bucket_root[1 << (2 * BH_TOP)];
+  struct bh_nodes pool[POOL_MAX_THREADS];
+  struct bh_nodes tree;
+  int root;
+} bh;
+
+static uint32_t bh_spread(uint32_t v) {
+  v = (v | (v << 8)) & 0x00ff00ff;
+  v = (v | (v << 4)) & 0x0f0f0f0f;
+  v = (v | (v << 2)) & 0x33333333;
+  v = (v | (v << 1)) & 0x55555555;
+  return v;
+}
+
+static uint32_t bh_quantise(float v) {
+  int q = v * bh.scale;
+  return q < 0 ? 0 : q > 65534 ? 65534 : q;
+}
+
+static void bh_keys(int i, int n) {
+  int lo, hi, c;
+  slice_of(i, n, &lo, &hi);
+  for (c = lo; c < hi; c++) {
+    float x = particles.x[c];
+    bh.order[c] = c;
+    if (x == DEAD_PARTICLE_MARKER) {
+      bh.key[c] = 0xffffffff;  /* dead ones sort to the end */
+    } else {
+      bh.key[c] = (bh_spread(bh_quantise(particles.y[c] + screen.height)) << 1)
+	| bh_spread(bh_quantise(x + screen.width));
+    }
+  }
+}
+
+static void bh_radix_count(int i, int n) {
+  int *h = bh.hist[i];
+  int lo, hi, c;
+  slice_of(i, n, &lo, &hi);
+  memset(h, 0, sizeof(bh.hist[i]));
+  for (c = lo; c < hi; c++) {
+    h[(bh.key[c] >> bh.shift) & 0xff]++;
+  }
+}
+
+static void bh_radix_scatter(int i, int n) {
+  int *h = bh.hist[i];
+  int lo, hi, c;
+  slice_of(i, n, &lo, &hi);
+  for (c = lo; c < hi; c++) {
+    int k = h[(bh.key[c] >> bh.shift) & 0xff]++;
+    bh.key2[k] = bh.key[c];
+    bh.order2[k] = bh.order[c];
+  }
+}
+
+static void bh_sort(void) {
+  TRACE_SCOPE("bh_sort");
+  for (bh.shift = 0; bh.shift < 32; bh.shift += 8) {
+    uint32_t *k;
+    int *o;
+    int d, t, pos = 0;
+
+    pool_run(bh_radix_count);
+    for (d = 0; d < 256; d++) {
+      for (t = 0; t < pool.n; t++) {
+	int count = bh.hist[t][d];
+	bh.hist[t][d] = pos;
+	pos += count;
+      }
+    }
+    pool_run(bh_radix_scatter);
+
+    k = bh.key, bh.key = bh.key2, bh.key2 = k;
+    o = bh.order, bh.order = bh.order2, bh.order2 = o;
+  }
+}
+
+static void bh_gather(int i, int n) {
+  int lo, hi, c;
+  slice_of(i, n, &lo, &hi);
+  for (c = lo; c < MIN(hi, bh.n_bodies); c++) {
+    bh.bx[c] = particles.x[bh.order[c]];
+    bh.by[c] = particles.y[bh.order[c]];
+  }
+}
+
+static int bh_push(struct bh_nodes *t) {
+  if (t->n == t->max) {
+    t->max = t->max ? 2 * t->max : 1024;
+    t->node = realloc(t->node, t->max * sizeof(struct bh_node));
+    if (t->node == NULL) {
+      perror("realloc");
+      exit(1);
+    }
+  }
+  return t->n++;
+}
+
+/* The first body in [lo, hi) whose key, shifted down, is above v. */
+static int bh_upper(int lo, int hi, int shift, uint32_t v) {
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if ((bh.key[mid] >> shift) <= v) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+/* Builds the subtree for bodies lo to hi, which share a square
+   level levels down, and returns its root. */
+static int bh_build(struct bh_nodes *t, int lo, int hi, int level) {
+  int me = bh_push(t);
+  struct bh_node nd;
+  double sx = 0, sy = 0;
+  int q, j;
+
+  nd.size = bh.side / (1 << level);
+  nd.lo = lo;
+  nd.hi = hi;
+  nd.leaf = hi - lo <= BH_LEAF || level == 16;
+  for (q = 0; q < 4; q++) nd.child[q] = -1;
+
+  if (nd.leaf) {
+    for (j = lo; j < hi; j++) {
+      sx += bh.bx[j];
+      sy += bh.by[j];
+    }
+  } else {
+    int shift = 2 * (15 - level);
+    int a = lo;
+    for (q = 0; q < 4; q++) {
+      int b = bh_upper(a, hi, shift, (bh.key[lo] >> shift & ~3u) | q);
+      if (b > a) {
+	int c = bh_build(t, a, b, level + 1);
+	sx += (double) t->node[c].x * (b - a);
+	sy += (double) t->node[c].y * (b - a);
+	nd.child[q] = c;
+      }
+      a = b;
+    }
+  }
+  nd.x = sx / (hi - lo);
+  nd.y = sy / (hi - lo);
+  nd.mass = (hi - lo) * PARTICLE_MASS;
+  t->node[me] = nd;
+  return me;
+}
+
+static void bh_build_buckets(int i, int n) {
+  struct bh_nodes *t = &bh.pool[i];
+  int b;
+  TRACE_SCOPE("bh_build");
+  t->n = 0;
+  for (b = i; b < (1 << (2 * BH_TOP)); b += n) {
+    int lo = bh.bucket_lo[b];
+    int hi = bh.bucket_lo[b + 1];
+    bh.bucket_root[b] = lo < hi ? bh_build(t, lo, hi, BH_TOP) : -1;
+  }
+}
+
+/* The levels above the buckets, built from them. */
+static int bh_top(int level, int prefix) {
+  struct bh_node nd;
+  double sx = 0, sy = 0;
+  int q, me, bodies = 0;
+
+  if (level == BH_TOP) return bh.bucket_root[prefix];
+
+  nd.size = bh.side / (1 << level);
+  nd.leaf = 0;
+  nd.lo = bh.n_bodies;
+  nd.hi = 0;
+  for (q = 0; q < 4; q++) {
+    int c = bh_top(level + 1, prefix * 4 + q);
+    nd.child[q] = c;
+    if (c >= 0) {
+      struct bh_node *ch = &bh.tree.node[c];
+      int count = ch->hi - ch->lo;
+      sx += (double) ch->x * count;
+      sy += (double) ch->y * count;
+      bodies += count;
+      nd.lo = MIN(nd.lo, ch->lo);
+      nd.hi = MAX(nd.hi, ch->hi);
+    }
+  }
+  if (bodies == 0) return -1;
+  nd.x = sx / bodies;
+  nd.y = sy / bodies;
+  nd.mass = bodies * PARTICLE_MASS;
+  me = bh_push(&bh.tree);
+  bh.tree.node[me] = nd;
+  return me;
+}
+
+static void bh_build_tree(void) {
+  int b, i, q;
+  TRACE_SCOPE("bh_tree");
+
+  for (b = 0; b < (1 << (2 * BH_TOP)); b++) {
+    bh.bucket_lo[b] = b ? bh_upper(0, bh.n_bodies, 32 - 2 * BH_TOP, b - 1) : 0;
+  }
+  bh.bucket_lo[b] = bh.n_bodies;
+  pool_run(bh_build_buckets);
+
+  /* Pull the subtrees together into one array. */
+  bh.tree.n = 0;
+  for (i = 0; i < pool.n; i++) {
+    struct bh_nodes *t = &bh.pool[i];
+    int offset = bh.tree.n;
+    int k;
+    for (k = 0; k < t->n; k++) {
+      int me = bh_push(&bh.tree);
+      struct bh_node *nd = &bh.tree.node[me];
+      *nd = t->node[k];
+      for (q = 0; q < 4; q++) {
+	if (nd->child[q] >= 0) nd->child[q] += offset;
+      }
+    }
+    for (b = i; b < (1 << (2 * BH_TOP)); b += pool.n) {
+      if (bh.bucket_root[b] >= 0) bh.bucket_root[b] += offset;
+    }
+  }
+  bh.root = bh_top(0, 0);
+}
+
+/* Bodies walk the tree BH_GROUP at a time, consecutive in key order,
+   so close together: a square is opened if it is too near any of
+   them. What comes out is a list of masses that every body in the
+   group then adds up. A body finds itself on its own list, but the
+   softening makes its pull on itself exactly zero. */
+#define BH_GROUP 64
+
+struct bh_list {
+  float *x, *y, *mass;
+  int n, max;
+};
+
+static struct bh_list bh_lists[POOL_MAX_THREADS];
+
+static void bh_list_add(struct bh_list *l, float x, float y, float mass) {
+  if (l->n == l->max) {
+    l->max = l->max ? 2 * l->max : 1024;
+    l->x = realloc(l->x, l->max * sizeof(float));
+    l->y = realloc(l->y, l->max * sizeof(float));
+    l->mass = realloc(l->mass, l->max * sizeof(float));
+    if (l->x == NULL || l->y == NULL || l->mass == NULL) {
+      perror("realloc");
+      exit(1);
+    }
+  }
+  l->x[l->n] = x;
+  l->y[l->n] = y;
+  l->mass[l->n] = mass;
+  l->n++;
+}
+
+static void bh_walk(struct bh_list *l, float x0, float y0, float x1, float y1) {
+  int stack[64];
+  int sp = 0;
+  int q, j;
+
+  l->n = 0;
+  if (bh.root >= 0) stack[sp++] = bh.root;
+  while (sp) {
+    struct bh_node *nd = &bh.tree.node[stack[--sp]];
+    float dx = MAX(MAX(x0 - nd->x, nd->x - x1), 0);
+    float dy = MAX(MAX(y0 - nd->y, nd->y - y1), 0);
+    /* Leaves only hold more than BH_LEAF bodies when they are far
+       smaller than the softening, so those are never opened. */
+    if (nd->size * nd->size < bh.theta2 * (dx * dx + dy * dy)
+	|| (nd->leaf && nd->hi - nd->lo > BH_LEAF)) {
+      bh_list_add(l, nd->x, nd->y, nd->mass);
+    } else if (nd->leaf) {
+      for (j = nd->lo; j < nd->hi; j++) {
+	bh_list_add(l, bh.bx[j], bh.by[j], PARTICLE_MASS);
+      }
+    } else {
+      for (q = 3; q >= 0; q--) {
+	if (nd->child[q] >= 0) stack[sp++] = nd->child[q];
+      }
+    }
+  }
+}
+
+/* Adds up the pull of everything on the list on 16 bodies of a
+   group. The inner loop runs across the bodies, so the vector versions
+   below can do them all at once without changing the order of any
+   body's sum. */
+static void bh_sum_scalar(struct bh_list *l, const float *px, const float *py, float *ax, float *ay) {
+  const float eps2 = BH_SOFTENING * BH_SOFTENING;
+  int j, k;
+  for (j = 0; j < 16; j++) {
+    ax[j] = ay[j] = 0;
+  }
+  for (k = 0; k < l->n; k++) {
+    for (j = 0; j < 16; j++) {
+      float dx = l->x[k] - px[j];
+      float dy = l->y[k] - py[j];
+      float r2 = dx * dx + dy * dy + eps2;
+      float f = l->mass[k] / (r2 * sqrtf(r2));
+      ax[j] += f * dx;
+      ay[j] += f * dy;
+    }
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/* 1/r^3 from rsqrt and a Newton step, as in integrate_avx2(). */
+__attribute__((target("avx2,fma")))
+static void bh_sum_avx2(struct bh_list *l, const float *px, const float *py, float *ax, float *ay) {
+  const __m256 eps2 = _mm256_set1_ps(BH_SOFTENING * BH_SOFTENING);
+  const __m256 half = _mm256_set1_ps(0.5f);
+  const __m256 three_halves = _mm256_set1_ps(1.5f);
+  __m256 px0 = _mm256_loadu_ps(px), px1 = _mm256_loadu_ps(px + 8);
+  __m256 py0 = _mm256_loadu_ps(py), py1 = _mm256_loadu_ps(py + 8);
+  __m256 ax0 = _mm256_setzero_ps(), ax1 = _mm256_setzero_ps();
+  __m256 ay0 = _mm256_setzero_ps(), ay1 = _mm256_setzero_ps();
+  int k;
+
+  for (k = 0; k < l->n; k++) {
+    __m256 lx = _mm256_set1_ps(l->x[k]);
+    __m256 ly = _mm256_set1_ps(l->y[k]);
+    __m256 lm = _mm256_set1_ps(l->mass[k]);
+    __m256 dx0 = _mm256_sub_ps(lx, px0), dx1 = _mm256_sub_ps(lx, px1);
+    __m256 dy0 = _mm256_sub_ps(ly, py0), dy1 = _mm256_sub_ps(ly, py1);
+    __m256 r20 = _mm256_fmadd_ps(dx0, dx0, _mm256_fmadd_ps(dy0, dy0, eps2));
+    __m256 r21 = _mm256_fmadd_ps(dx1, dx1, _mm256_fmadd_ps(dy1, dy1, eps2));
+    __m256 r0 = _mm256_rsqrt_ps(r20), r1 = _mm256_rsqrt_ps(r21);
+    __m256 f0, f1;
+    r0 = _mm256_mul_ps(r0, _mm256_fnmadd_ps(_mm256_mul_ps(half, r20), _mm256_mul_ps(r0, r0), three_halves));
+    r1 = _mm256_mul_ps(r1, _mm256_fnmadd_ps(_mm256_mul_ps(half, r21), _mm256_mul_ps(r1, r1), three_halves));
+    f0 = _mm256_mul_ps(lm, _mm256_mul_ps(r0, _mm256_mul_ps(r0, r0)));
+    f1 = _mm256_mul_ps(lm, _mm256_mul_ps(r1, _mm256_mul_ps(r1, r1)));
+    ax0 = _mm256_fmadd_ps(f0, dx0, ax0);
+    ax1 = _mm256_fmadd_ps(f1, dx1, ax1);
+    ay0 = _mm256_fmadd_ps(f0, dy0, ay0);
+    ay1 = _mm256_fmadd_ps(f1, dy1, ay1);
+  }
+  _mm256_storeu_ps(ax, ax0);
+  _mm256_storeu_ps(ax + 8, ax1);
+  _mm256_storeu_ps(ay, ay0);
+  _mm256_storeu_ps(ay + 8, ay1);
+}
+
+__attribute__((target("avx512f")))
+static void bh_sum_avx512(struct bh_list *l, const float *px, const float *py, float *ax, float *ay) {
+  const __m512 eps2 = _mm512_set1_ps(BH_SOFTENING * BH_SOFTENING);
+  const __m512 half = _mm512_set1_ps(0.5f);
+  const __m512 three_halves = _mm512_set1_ps(1.5f);
+  __m512 x = _mm512_loadu_ps(px);
+  __m512 y = _mm512_loadu_ps(py);
+  __m512 sx = _mm512_setzero_ps();
+  __m512 sy = _mm512_setzero_ps();
+  int k;
+
+  for (k = 0; k < l->n; k++) {
+    __m512 dx = _mm512_sub_ps(_mm512_set1_ps(l->x[k]), x);
+    __m512 dy = _mm512_sub_ps(_mm512_set1_ps(l->y[k]), y);
+    __m512 r2 = _mm512_fmadd_ps(dx, dx, _mm512_fmadd_ps(dy, dy, eps2));
+    __m512 r = _mm512_rsqrt14_ps(r2);
+    __m512 f;
+    r = _mm512_mul_ps(r, _mm512_fnmadd_ps(_mm512_mul_ps(half, r2), _mm512_mul_ps(r, r), three_halves));
+    f = _mm512_mul_ps(_mm512_set1_ps(l->mass[k]), _mm512_mul_ps(r, _mm512_mul_ps(r, r)));
+    sx = _mm512_fmadd_ps(f, dx, sx);
+    sy = _mm512_fmadd_ps(f, dy, sy);
+  }
+  _mm512_storeu_ps(ax, sx);
+  _mm512_storeu_ps(ay, sy);
+}
+#endif
+
+static void (*bh_sum)(struct bh_list *l, const float *px, const float *py, float *ax, float *ay) = bh_sum_scalar;
+
+static void bh_force(int i, int n) {
+  struct bh_list *l = &bh_lists[i];
+  float px[BH_GROUP], py[BH_GROUP], ax[BH_GROUP], ay[BH_GROUP];
+  int per, lo, hi, g, j;
+  TRACE_SCOPE("bh_force");
+
+  /* Whole groups each, so the groups don't depend on the thread count. */
+  per = ((bh.n_bodies + BH_GROUP - 1) / BH_GROUP + n - 1) / n * BH_GROUP;
+  lo = MIN(i * per, bh.n_bodies);
+  hi = MIN(lo + per, bh.n_bodies);
+  for (g = lo; g < hi; g += BH_GROUP) {
+    int end = MIN(g + BH_GROUP, hi);
+    float x0 = bh.bx[g], x1 = bh.bx[g];
+    float y0 = bh.by[g], y1 = bh.by[g];
+    for (j = 0; j < BH_GROUP; j++) {
+      /* The last group is padded out with copies of its last body. */
+      px[j] = bh.bx[MIN(g + j, end - 1)];
+      py[j] = bh.by[MIN(g + j, end - 1)];
+      x0 = MIN(x0, px[j]);
+      x1 = MAX(x1, px[j]);
+      y0 = MIN(y0, py[j]);
+      y1 = MAX(y1, py[j]);
+    }
+    bh_walk(l, x0, y0, x1, y1);
+    for (j = 0; j < BH_GROUP; j += 16) {
+      bh_sum(l, px + j, py + j, ax + j, ay + j);
+    }
+    for (j = g; j < end; j++) {
+      particles.vx[bh.order[j]] += ax[j - g];
+      particles.vy[bh.order[j]] += ay[j - g];
+    }
+  }
+}
+
+/* Gives every particle its pull from all the others. */
+static void bh_step(void) {
+  pool_run(bh_keys);
+  bh_sort();
+  bh.n_bodies = particles.live;
+  pool_run(bh_gather);
+  bh_build_tree();
+  pool_run(bh_force);
+}
+
+static void setup_nbody(void) {
+  const char *s = getenv("LFLOW_THETA");
+  float theta = s ? atof(s) : BH_THETA;
+
+  bh.theta2 = theta * theta;
+#if defined(__x86_64__) || defined(__i386__)
+  if (integrate == integrate_avx2) bh_sum = bh_sum_avx2;
+  if (integrate == integrate_avx512) bh_sum = bh_sum_avx512;
+#endif
+  bh.side = 3 * MAX(screen.width, screen.height);
+  bh.scale = 65536 / bh.side;
+  bh.key = malloc(n_slots * sizeof(uint32_t));
+  bh.key2 = malloc(n_slots * sizeof(uint32_t));
+  bh.order = malloc(n_slots * sizeof(int));
+  bh.order2 = malloc(n_slots * sizeof(int));
+  bh.bx = malloc(n_slots * sizeof(float));
+  bh.by = malloc(n_slots * sizeof(float));
+  bh.hist = malloc(pool.n * sizeof(*bh.hist));
+  if (bh.key == NULL || bh.key2 == NULL || bh.order == NULL || bh.order2 == NULL
+      || bh.bx == NULL || bh.by == NULL || bh.hist == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+}
+#endif
+
+#if WANT_FIELD
+/* Many fixed attractors, added up once into a coarse grid of
+   accelerations covering everywhere a particle can be. Particles then
+   read their pull off the grid, interpolating between the four grid
+   points around them, so it costs the same whatever the number of
+   attractors. The masses that follow the mouse are still done exactly
+   in integrate(). Setting field.dirty has the grid rebuilt, for when
+   the attractors move. */
+#define N_ATTRACTORS 1000
+#define ATTRACTOR_MASS 20
+#define FIELD_CELL 16       /* pixels between grid points; also the softening */
+
+static struct field {
+  int w, h;                 /* grid points */
+  float *ax, *ay;
+  struct mass *attractors;
+  int n_attractors;
+  int dirty;
+} field;
+
+/* Builds grid row gy. Going across the row in the inner loop lets it
+   be vectorised; m is never negative, so sqrtf can't fail. */
+__attribute__((optimize("no-math-errno")))
+static void field_row(int gy) {
+  float *ax = field.ax + gy * field.w;
+  float *ay = field.ay + gy * field.w;
+  float py = gy * FIELD_CELL - screen.height;
+  int gx, k;
+
+  for (gx = 0; gx < field.w; gx++) {
+    ax[gx] = ay[gx] = 0;
+  }
+  for (k = 0; k < field.n_attractors; k++) {
+    struct mass a = field.attractors[k];
+    float dy = a.y - py;
+    float dy2 = dy * dy + FIELD_CELL * FIELD_CELL;
+    for (gx = 0; gx < field.w; gx++) {
+      float dx = a.x - (gx * FIELD_CELL - screen.width);
+      float m = dx * dx + dy2;
+      float f = a.mass / (m * sqrtf(m));
+      ax[gx] += f * dx;
+      ay[gx] += f * dy;
+    }
+  }
+}
+
+static void field_build(int i, int n) {
+  int gy;
+  TRACE_SCOPE("field_build");
+  for (gy = i * field.h / n; gy < (i + 1) * field.h / n; gy++) {
+    field_row(gy);
+  }
+}
+
+static void field_apply(int i, int n) {
+  const float *ax = field.ax, *ay = field.ay;
+  const int w = field.w;
+  int lo, hi, c;
+  TRACE_SCOPE("field");
+
+  slice_of(i, n, &lo, &hi);
+  for (c = lo; c < hi; c++) {
+    float gx = (particles.x[c] + screen.width) * (1.0f / FIELD_CELL);
+    float gy = (particles.y[c] + screen.height) * (1.0f / FIELD_CELL);
+    float fx, fy;
+    int k;
+    /* Also skips the dead, which are far off the grid. */
+    if (!(gx >= 0 && gy >= 0 && gx < w - 1 && gy < field.h - 1)) continue;
+    k = (int) gy * w + (int) gx;
+    fx = gx - (int) gx;
+    fy = gy - (int) gy;
+    particles.vx[c] += (ax[k] + (ax[k + 1] - ax[k]) * fx) * (1 - fy)
+      + (ax[k + w] + (ax[k + w + 1] - ax[k + w]) * fx) * fy;
+    particles.vy[c] += (ay[k] + (ay[k + 1] - ay[k]) * fx) * (1 - fy)
+      + (ay[k + w] + (ay[k + w + 1] - ay[k + w]) * fx) * fy;
   }
 }
 
+static void setup_field(void) {
+  struct rng r;
+  int k;
+
+  field.w = 3 * screen.width / FIELD_CELL + 2;
+  field.h = 3 * screen.height / FIELD_CELL + 2;
+  field.ax = malloc((size_t) field.w * field.h * sizeof(float));
+  field.ay = malloc((size_t) field.w * field.h * sizeof(float));
+  field.n_attractors = N_ATTRACTORS;
+  field.attractors = malloc(N_ATTRACTORS * sizeof(struct mass));
+  if (field.ax == NULL || field.ay == NULL || field.attractors == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  r = rand_stream(RAND_FIELD);
+  for (k = 0; k < N_ATTRACTORS; k++) {
+    field.attractors[k].x = rand_below(&r, screen.width);
+    field.attractors[k].y = rand_below(&r, screen.height);
+    field.attractors[k].mass = ATTRACTOR_MASS;
+  }
+  field.dirty = 1;
+}
+#endif
+
 static int mkcolor(int R, int G, int B) {
   return (R << 16) | (G << 8) | B;
 }
@@ -123,47 +1610,20 @@ static void setup_colors(void) {
   }
 }
 
-static void clrscr(void) {
-  memset(screen.shadow,
-	 0,
-	 ((screen.height-1) * screen.stride + screen.width) * sizeof(uint32_t));
-}
-
-static void putpixel(int x, int y, int c) {
-  screen.shadow[y * screen.stride + x] = c;
-}
-
-static int getpixel(int x, int y) {
-  return screen.shadow[y * screen.stride + x];
-}
-
 static void do_frame() {
   Point loc;
-  int x, y, c;
+  int c;
+  TRACE_SCOPE("do_frame");
 
-  //GetMouse(&loc);
-  loc.h = 100;
-  loc.v = 100;
+  input_mouse(&loc);
 
   if (frame_counter == 0) {
     clrscr();
   } else {
 
-#if WANT_FADE
-    for (y = 0; y < screen.height; y++) {
-      for (x = 0; x < screen.width; x++) {
-	int p = getpixel(x, y);
-	if (p) {
-	  int R = (p >> 16) & 0xff;
-	  int G = (p >> 8) & 0xff;
-	  int B = p & 0xff;
-	  R = (int) R * FADE_FACTOR;
-	  G = (int) G * FADE_FACTOR;
-	  B = (int) B * FADE_FACTOR;
-	  p = (R << 16) | (G << 8) | B;
-	  putpixel(x, y, p);
-	}
-      }
+#if WANT_FADE && !WANT_DENSITY
+    if (!fused_fade) {
+      fade_frame();
     }
 #endif
 
@@ -175,100 +1635,126 @@ static void do_frame() {
     masses[1].y = screen.height - loc.v;
     masses[1].mass = M2;
 
-    for (c = 0; c < N_PARTICLES; c++) {
-      struct particle *p = &particles[c];
-      int bodynum;
-      int color_index;
-      float oldx = p->x;
-      float oldy = p->y;
-
-#if !WANT_REPLACEMENTS
-      if (oldx == DEAD_PARTICLE_MARKER)
-	continue;
-#endif
-
-      for (bodynum = 0; bodynum < N_MASSES; bodynum++) {
-	float dx = masses[bodynum].x - p->x;
-	float dy = masses[bodynum].y - p->y;
-	float m = dx * dx + dy * dy;
-	float k = masses[bodynum].mass / (m * sqrt(m));
-	float dvx = k * dx;
-	float dvy = k * dy;
-	if (m < MASS_CLIP) {
-#if WANT_REPLACEMENTS
-	  init_particle(p);
-#else
-	  p->x = DEAD_PARTICLE_MARKER;
+    bench_begin(PHASE_PHYSICS);
+#if WANT_FIELD
+    if (field.dirty) {
+      pool_run(field_build);
+      field.dirty = 0;
+    }
+    pool_run(field_apply);
 #endif
-	  goto done_particle;
-	}
-	p->vx += dvx;
-	p->vy += dvy;
+#if WANT_NBODY
+    bh_step();
+#endif
+    if (!tiled) {
+      physics_serial();
+    } else {
+      pool_run(physics_integrate);
+      for (c = 0; c < pool.n; c++) {
+	particles.live -= slice_died[c];
       }
-
-      color_index = sqrt(p->vx * p->vx + p->vy * p->vy) * 200;
-      if (color_index > MAX_COLOR) color_index = MAX_COLOR;
-      color_index = MAX_COLOR - color_index;
-
-      p->x = p->x + p->vx;
-      p->y = p->y + p->vy;
-      if ((p->x < 0) || (p->y < 0) || (p->x >= screen.width) || (p->y >= screen.height)) {
-	if ((p->x < -screen.width) || (p->y < -screen.height) || (p->x >= screen.width * 2) || (p->y > screen.height * 2)) {
+      physics_offsets();
+      pool_run(physics_bin);
+      pool_run(physics_draw);
+    }
 #if WANT_REPLACEMENTS
-	  init_particle(p);
+    for (c = 0; c < n_particles; c++) {
+      if (particles.x[c] == DEAD_PARTICLE_MARKER) {
+	init_particle(c, frame_counter);
+      }
+    }
+    particles.live = n_particles;
 #else
-	  p->x = DEAD_PARTICLE_MARKER;
+    compact_particles();
 #endif
-	}
-      } else {
-	putpixel(p->x, p->y, colors[color_index]);
-      }
-    done_particle:
-#if ERASE_TRACKS
-      if (oldx >= 0 && oldy >= 0 && oldx < screen.width && oldy < screen.height) {
-	putpixel(oldx, oldy, 0);
-      }
+    bench_end(PHASE_PHYSICS);
+#if WANT_DENSITY
+    bench_begin(PHASE_SHADING);
+    pool_run(density_resolve);
+    bench_end(PHASE_SHADING);
 #endif
-      continue;
-    }
+    bench_stat("live", particles.live);
+    bench_stat("dead", n_particles - particles.live);
   }
 }
 
 int main(int argc, char *argv[]) {
   struct timeval t_start, t_stop;
+  struct pacer pacer;
+
+  bench_parse_args(argc, argv);
+  rand_setup(bench_seed());
 
-  setup_screen();
+  setup_screen(WANT_INDEXED ? SCREEN_DIRECT : SCREEN_SHADOW);
   setup_colors();
+  setup_fade(FADE_FACTOR);
+#if FUSED_FADE
+  fused_fade = WANT_INDEXED || (!screen.flip && screen.shadow != screen.base);
+#endif
+#if WANT_FADE && WANT_LAZY_FADE
+  if (!fade_decrements) {
+    fprintf(stderr, "WANT_LAZY_FADE needs a FADE_FACTOR that takes one off each channel\n");
+    exit(1);
+  }
+  row_drawn = malloc(screen.height * sizeof(int));
+  {
+    int y;
+    for (y = 0; y < screen.height; y++) row_drawn[y] = -256;
+  }
+#endif
+  pool_start();
   setup_particles();
+  setup_integrate();
+  setup_physics();
+#if WANT_NBODY
+  setup_nbody();
+#endif
+#if WANT_FIELD
+  setup_field();
+#endif
+#if WANT_DENSITY
+  setup_density();
+#endif
+#if WANT_INDEXED
+  setup_indexed();
+#endif
 
   gettimeofday(&t_start, NULL);
-
-  srandom(time(NULL));
+  pacer_start(&pacer, bench_fps(TARGET_FPS));
+  bench_start();
 
   frame_counter = 0;
-  while (1) {
+  while (bench_running(frame_counter)) {
     do_frame();
-    memcpy(screen.base, screen.shadow, screen.stride * screen.height * sizeof(uint32_t));
+    bench_begin(PHASE_PRESENT);
+#if WANT_FADE && WANT_LAZY_FADE
+    fade_now = frame_counter;
+    screen_present_with(fade_resolve);
+#elif FUSED_FADE
+    if (fused_fade && frame_counter > 0) {
+      present_and_fade();
+    } else {
+      screen_present();
+    }
+#else
+    screen_present();
+#endif
+    bench_end(PHASE_PRESENT);
+    bench_frame_done(frame_counter);
     frame_counter++;
 
-    {
-      struct timeval t_now;
-      gettimeofday(&t_now, NULL);
-      signed long d = (t_now.tv_sec - t_start.tv_sec) * 1000000 + (t_now.tv_usec - t_start.tv_usec);
-      long nap = frame_counter * (1000000 / 75) - d;
-      if (nap > 0) {
-    	usleep(nap);
-      }
-    }
+    pacer_wait(&pacer);
   }
 
   gettimeofday(&t_stop, NULL);
 
   {
     long delta = (t_stop.tv_sec - t_start.tv_sec) * 1000000 + (t_stop.tv_usec - t_start.tv_usec);
-    printf("%d frames took %lu microseconds, so %g frames/sec\n",
+    fprintf(bench.log, "%d frames took %lu microseconds, so %g frames/sec\n",
 	   frame_counter,
 	   delta,
 	   frame_counter / (delta / 1000000.0));
+    pacer_report(&pacer, bench.log);
+    bench_report(&pacer);
   }
 }